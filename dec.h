@@ -15,9 +15,11 @@
 #endif
 
 extern int fswc_add_image_bayer(avgbmp_t *dst, uint8_t *img, uint32_t length, uint32_t w, uint32_t h, int palette);
+extern int fswc_sample_bayer(uint8_t *img, uint32_t length, uint32_t w, uint32_t h, int palette, uint32_t x, uint32_t y, int *rgb);
 
 extern int fswc_add_image_y16(src_t *src, avgbmp_t *abitmap);
 extern int fswc_add_image_grey(src_t *src, avgbmp_t *abitmap);
+extern int fswc_sample_grey(src_t *src, uint32_t x, uint32_t y, int *rgb);
 
 extern int fswc_add_image_jpeg(src_t *src, avgbmp_t *abitmap);
 
@@ -29,10 +31,13 @@ extern int fswc_add_image_rgb24(src_t *src, avgbmp_t *abitmap);
 extern int fswc_add_image_bgr24(src_t *src, avgbmp_t *abitmap);
 extern int fswc_add_image_rgb565(src_t *src, avgbmp_t *abitmap);
 extern int fswc_add_image_rgb555(src_t *src, avgbmp_t *abitmap);
+extern int fswc_sample_rgb(src_t *src, uint32_t x, uint32_t y, int *rgb);
 
 extern int fswc_add_image_yuyv(src_t *src, avgbmp_t *abitmap);
 extern int fswc_add_image_yuv420p(src_t *src, avgbmp_t *abitmap);
+extern int fswc_add_image_nv12(src_t *src, avgbmp_t *abitmap);
 extern int fswc_add_image_nv12mb(src_t *src, avgbmp_t *abitmap);
+extern int fswc_sample_yuv(src_t *src, uint32_t x, uint32_t y, int *rgb);
 
 extern int fswc_add_image_s561(avgbmp_t *dst, uint8_t *img, uint32_t length, uint32_t width, uint32_t height, int palette);
 
@@ -15,6 +15,87 @@
 #include "fswebcam.h"
 #include "src.h"
 
+/* SBGGR8 bayer pattern:
+ * 
+ * BGBGBGBGBG
+ * GRGRGRGRGR
+ * BGBGBGBGBG
+ * GRGRGRGRGR
+ * 
+ * SGBRG8 bayer pattern:
+ * 
+ * GBGBGBGBGB
+ * RGRGRGRGRG
+ * GBGBGBGBGB
+ * RGRGRGRGRG
+ *
+ * SGRBG8 bayer pattern:
+ *
+ * GRGRGRGRGR
+ * BGBGBGBGBG
+ * GRGRGRGRGR
+ * BGBGBGBGBG
+*/
+
+static inline void fswc_bayer_rgb(uint8_t *img, uint32_t x, uint32_t y, uint32_t w, uint32_t h, int palette, uint8_t *rgb)
+{
+	uint8_t *p[8];
+	uint8_t hn, vn, di;
+	uint8_t r, g, b;
+	int mode;
+	
+	/* Setup pointers to this pixel's neighbours. */
+	p[0] = img - w - 1;
+	p[1] = img - w;
+	p[2] = img - w + 1;
+	p[3] = img - 1;
+	p[4] = img + 1;
+	p[5] = img + w - 1;
+	p[6] = img + w;
+	p[7] = img + w + 1;
+	
+	/* Juggle pointers if they are out of bounds. */
+	if(!y)              { p[0]=p[5]; p[1]=p[6]; p[2]=p[7]; }
+	else if(y == h - 1) { p[5]=p[0]; p[6]=p[1]; p[7]=p[2]; }
+	if(!x)              { p[0]=p[2]; p[3]=p[4]; p[5]=p[7]; }
+	else if(x == w - 1) { p[2]=p[0]; p[4]=p[3]; p[7]=p[5]; }
+	
+	/* Average matching neighbours. */
+	hn = (*p[3] + *p[4]) / 2;
+	vn = (*p[1] + *p[6]) / 2;
+	di = (*p[0] + *p[2] + *p[5] + *p[7]) / 4;
+	
+	/* Calculate RGB */
+	if(palette == SRC_PAL_SBGGR8 ||
+	   palette == SRC_PAL_SRGGB8 ||
+	   palette == SRC_PAL_BAYER) {
+		mode = (x + y) & 0x01;
+	} else {
+		mode = ~(x + y) & 0x01;
+	}
+	
+	if(mode)
+	{
+		g = *img;
+		if(y & 0x01) { r = hn; b = vn; }
+		else         { r = vn; b = hn; }
+	}
+	else if(y & 0x01) { r = *img; g = (vn + hn) / 2; b = di; }
+	else              { b = *img; g = (vn + hn) / 2; r = di; }
+	
+	if(palette == SRC_PAL_SGRBG8 ||
+	   palette == SRC_PAL_SRGGB8)
+	{
+		uint8_t t = r;
+		r = b;
+		b = t;
+	}
+	
+	rgb[0] = r;
+	rgb[1] = g;
+	rgb[2] = b;
+}
+
 int fswc_add_image_bayer(avgbmp_t *dst, uint8_t *img, uint32_t length, uint32_t w, uint32_t h, int palette)
 {
 	uint32_t x = 0, y = 0;
@@ -22,85 +103,15 @@ int fswc_add_image_bayer(avgbmp_t *dst, uint8_t *img, uint32_t length, uint32_t
 	
 	if(length < i) return(-1);
 	
-	/* SBGGR8 bayer pattern:
-	 * 
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * 
-	 * SGBRG8 bayer pattern:
-	 * 
-	 * GBGBGBGBGB
-	 * RGRGRGRGRG
-	 * GBGBGBGBGB
-	 * RGRGRGRGRG
-	 *
-	 * SGRBG8 bayer pattern:
-	 *
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	 * GRGRGRGRGR
-	 * BGBGBGBGBG
-	*/
-	
 	while(i-- > 0)
 	{
-		uint8_t *p[8];
-		uint8_t hn, vn, di;
-		uint8_t r, g, b;
-		int mode;
-		
-		/* Setup pointers to this pixel's neighbours. */
-		p[0] = img - w - 1;
-		p[1] = img - w;
-		p[2] = img - w + 1;
-		p[3] = img - 1;
-		p[4] = img + 1;
-		p[5] = img + w - 1;
-		p[6] = img + w;
-		p[7] = img + w + 1;
-		
-		/* Juggle pointers if they are out of bounds. */
-		if(!y)              { p[0]=p[5]; p[1]=p[6]; p[2]=p[7]; }
-		else if(y == h - 1) { p[5]=p[0]; p[6]=p[1]; p[7]=p[2]; }
-		if(!x)              { p[0]=p[2]; p[3]=p[4]; p[5]=p[7]; }
-		else if(x == w - 1) { p[2]=p[0]; p[4]=p[3]; p[7]=p[5]; }
+		uint8_t rgb[3];
 		
-		/* Average matching neighbours. */
-		hn = (*p[3] + *p[4]) / 2;
-		vn = (*p[1] + *p[6]) / 2;
-		di = (*p[0] + *p[2] + *p[5] + *p[7]) / 4;
+		fswc_bayer_rgb(img, x, y, w, h, palette, rgb);
 		
-		/* Calculate RGB */
-		if(palette == SRC_PAL_SBGGR8 ||
-		   palette == SRC_PAL_SRGGB8 ||
-		   palette == SRC_PAL_BAYER) {
-			mode = (x + y) & 0x01;
-		} else {
-			mode = ~(x + y) & 0x01;
-		}
-		
-		if(mode)
-		{
-			g = *img;
-			if(y & 0x01) { r = hn; b = vn; }
-			else         { r = vn; b = hn; }
-		}
-		else if(y & 0x01) { r = *img; g = (vn + hn) / 2; b = di; }
-		else              { b = *img; g = (vn + hn) / 2; r = di; }
-		
-		if(palette == SRC_PAL_SGRBG8 ||
-		   palette == SRC_PAL_SRGGB8)
-		{
-			uint8_t t = r;
-			r = b;
-			b = t;
-		}
-		
-		*(dst++) += r;
-		*(dst++) += g;
-		*(dst++) += b;
+		*(dst++) += rgb[0];
+		*(dst++) += rgb[1];
+		*(dst++) += rgb[2];
 		
 		/* Move to the next pixel (or line) */
 		if(++x == w) { x = 0; y++; }
@@ -110,3 +121,19 @@ int fswc_add_image_bayer(avgbmp_t *dst, uint8_t *img, uint32_t length, uint32_t
 	return(0);
 }
 
+int fswc_sample_bayer(uint8_t *img, uint32_t length, uint32_t w, uint32_t h, int palette, uint32_t x, uint32_t y, int *rgb)
+{
+	uint8_t c[3];
+	
+	if(length < w * h) return(-1);
+	
+	/* The same as the decoder above, for just the one pixel. */
+	fswc_bayer_rgb(img + y * w + x, x, y, w, h, palette, c);
+	
+	rgb[0] = c[0];
+	rgb[1] = c[1];
+	rgb[2] = c[2];
+	
+	return(0);
+}
+
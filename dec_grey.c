@@ -49,3 +49,22 @@ int fswc_add_image_grey(src_t *src, avgbmp_t *abitmap)
 	return(0);
 }
 
+int fswc_sample_grey(src_t *src, uint32_t x, uint32_t y, int *rgb)
+{
+	uint32_t i = y * src->width + x;
+	uint32_t n = src->width * src->height;
+	
+	if(src->palette == SRC_PAL_Y16)
+	{
+		if(src->length < n * 2) return(-1);
+		rgb[0] = rgb[1] = rgb[2] = ((uint16_t *) src->img)[i] >> 8;
+	}
+	else
+	{
+		if(src->length < n) return(-1);
+		rgb[0] = rgb[1] = rgb[2] = ((uint8_t *) src->img)[i];
+	}
+	
+	return(0);
+}
+
@@ -15,6 +15,32 @@
 #include "fswebcam.h"
 #include "src.h"
 
+static inline void fswc_rgb565_rgb(uint16_t p, int *rgb)
+{
+	uint8_t r, g, b;
+	
+	r = (p & 0xF800) >> 8;
+	g = (p &  0x7E0) >> 3;
+	b = (p &   0x1F) << 3;
+	
+	rgb[0] = r + (r >> 5);
+	rgb[1] = g + (g >> 6);
+	rgb[2] = b + (b >> 5);
+}
+
+static inline void fswc_rgb555_rgb(uint16_t p, int *rgb)
+{
+	uint8_t r, g, b;
+	
+	r = (p & 0x7C00) >> 7;
+	g = (p &  0x3E0) >> 2;
+	b = (p &   0x1F) << 3;
+	
+	rgb[0] = r + (r >> 5);
+	rgb[1] = g + (g >> 5);
+	rgb[2] = b + (b >> 5);
+}
+
 int fswc_add_image_rgb32(src_t *src, avgbmp_t *abitmap)
 {
 	uint8_t *img = (uint8_t *) src->img;
@@ -92,17 +118,13 @@ int fswc_add_image_rgb565(src_t *src, avgbmp_t *abitmap)
 	
 	while(i-- > 0)
 	{
-		uint8_t r, g, b;
+		int rgb[3];
 		
-		r = (*img & 0xF800) >> 8;
-		g = (*img &  0x7E0) >> 3;
-		b = (*img &   0x1F) << 3;
+		fswc_rgb565_rgb(*(img++), rgb);
 		
-		*(abitmap++) += r + (r >> 5);
-		*(abitmap++) += g + (g >> 6);
-		*(abitmap++) += b + (b >> 5);
-		
-		img++;
+		*(abitmap++) += rgb[0];
+		*(abitmap++) += rgb[1];
+		*(abitmap++) += rgb[2];
 	}
 	
 	return(0);
@@ -117,17 +139,60 @@ int fswc_add_image_rgb555(src_t *src, avgbmp_t *abitmap)
 	
 	while(i-- > 0)
 	{
-		uint8_t r, g, b;
-		
-		r = (*img & 0x7C00) >> 7;
-		g = (*img &  0x3E0) >> 2;
-		b = (*img &   0x1F) << 3;
+		int rgb[3];
 		
-		*(abitmap++) += r + (r >> 5);
-		*(abitmap++) += g + (g >> 5);
-		*(abitmap++) += b + (b >> 5);
+		fswc_rgb555_rgb(*(img++), rgb);
 		
-		img++;
+		*(abitmap++) += rgb[0];
+		*(abitmap++) += rgb[1];
+		*(abitmap++) += rgb[2];
+	}
+	
+	return(0);
+}
+
+int fswc_sample_rgb(src_t *src, uint32_t x, uint32_t y, int *rgb)
+{
+	uint8_t *img = (uint8_t *) src->img;
+	uint32_t i = y * src->width + x;
+	
+	/* The same as the decoders above, for just the one pixel. */
+	switch(src->palette)
+	{
+	case SRC_PAL_RGB32:
+	case SRC_PAL_BGR32:
+	case SRC_PAL_ABGR32:
+		if(src->length < src->width * src->height * 4) return(-1);
+		img += i * 4;
+		break;
+	case SRC_PAL_RGB24:
+	case SRC_PAL_BGR24:
+		if(src->length < src->width * src->height * 3) return(-1);
+		img += i * 3;
+		break;
+	case SRC_PAL_RGB565:
+		if(src->length >> 1 < src->width * src->height) return(-1);
+		fswc_rgb565_rgb(((uint16_t *) img)[i], rgb);
+		return(0);
+	case SRC_PAL_RGB555:
+		if(src->length >> 1 < src->width * src->height) return(-1);
+		fswc_rgb555_rgb(((uint16_t *) img)[i], rgb);
+		return(0);
+	default:
+		return(-1);
+	}
+	
+	if(src->palette == SRC_PAL_RGB32 || src->palette == SRC_PAL_RGB24)
+	{
+		rgb[0] = img[0];
+		rgb[1] = img[1];
+		rgb[2] = img[2];
+	}
+	else
+	{
+		rgb[0] = img[2];
+		rgb[1] = img[1];
+		rgb[2] = img[0];
 	}
 	
 	return(0);
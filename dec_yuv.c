@@ -22,6 +22,95 @@
  * http://linuxbrit.co.uk/camE/
 */
 
+static inline void fswc_yuv_rgb(int y, int u, int v, int *rgb)
+{
+	y <<= 8;
+	u -= 128;
+	v -= 128;
+	
+	rgb[0] = CLIP((y + (359 * v)) >> 8, 0x00, 0xFF);
+	rgb[1] = CLIP((y - (88 * u) - (183 * v)) >> 8, 0x00, 0xFF);
+	rgb[2] = CLIP((y + (454 * u)) >> 8, 0x00, 0xFF);
+}
+
+static inline void fswc_yuyv_rgb(uint8_t *ptr, int z, int palette, int *rgb)
+{
+	/* YUYV and UYVY and VYUY are very similar and so  *
+	 * are all handled by this one function. */
+	if(palette == SRC_PAL_UYVY)
+		fswc_yuv_rgb(ptr[z ? 3 : 1], ptr[0], ptr[2], rgb);
+	else if(palette == SRC_PAL_VYUY)
+		fswc_yuv_rgb(ptr[z ? 3 : 1], ptr[2], ptr[0], rgb);
+	else
+		fswc_yuv_rgb(ptr[z ? 2 : 0], ptr[1], ptr[3], rgb);
+}
+
+typedef struct {
+	uint8_t *y, *u, *v;
+	uint32_t ystride, cstride, cheight;
+} fswc_planes_t;
+
+static int fswc_yuv420p_planes(src_t *src, fswc_planes_t *p)
+{
+	if(src->planes >= 3)
+	{
+		/* Each plane is stored in a separate buffer. */
+		p->y = (uint8_t *) src->plane[0];
+		p->u = (uint8_t *) src->plane[1];
+		p->v = (uint8_t *) src->plane[2];
+		p->ystride = src->plane_stride[0] ? src->plane_stride[0] : src->width;
+		p->cstride = src->plane_stride[1] ? src->plane_stride[1] : src->width / 2;
+		
+		if(src->plane_length[0] < p->ystride * src->height) return(-1);
+		if(src->plane_length[1] < p->cstride * src->height / 2) return(-1);
+		if(src->plane_length[2] < p->cstride * src->height / 2) return(-1);
+		
+		return(0);
+	}
+	
+	if(src->length < (src->width * src->height * 3) / 2) return(-1);
+	
+	/* Setup pointers to Y, U and V buffers. */
+	p->y = (uint8_t *) src->img;
+	p->u = p->y + (src->width * src->height);
+	p->v = p->u + (src->width * src->height / 4);
+	p->ystride = src->width;
+	p->cstride = src->width / 2;
+	
+	return(0);
+}
+
+static int fswc_nv12_planes(src_t *src, fswc_planes_t *p)
+{
+	/* NV16 has a full height chroma plane, NV12 a half height one. */
+	p->cheight = src->height;
+	if(src->palette == SRC_PAL_NV12) p->cheight /= 2;
+	
+	if(src->planes >= 2)
+	{
+		p->y = (uint8_t *) src->plane[0];
+		p->u = (uint8_t *) src->plane[1];
+		p->ystride = src->plane_stride[0] ? src->plane_stride[0] : src->width;
+		p->cstride = src->plane_stride[1] ? src->plane_stride[1] : src->width;
+		
+		if(src->plane_length[0] < p->ystride * src->height) return(-1);
+		if(src->plane_length[1] < p->cstride * p->cheight) return(-1);
+		
+		return(0);
+	}
+	
+	p->ystride = p->cstride = src->width;
+	if(src->planes && src->plane_stride[0])
+		p->ystride = p->cstride = src->plane_stride[0];
+	
+	if(src->length < p->ystride * (src->height + p->cheight)) return(-1);
+	
+	p->y = (uint8_t *) src->img;
+	p->u = p->y + p->ystride * src->height;
+	
+	return(0);
+}
+
 int fswc_add_image_yuyv(src_t *src, avgbmp_t *abitmap)
 {
 	uint8_t *ptr;
@@ -29,9 +118,6 @@ int fswc_add_image_yuyv(src_t *src, avgbmp_t *abitmap)
 	
 	if(src->length < (src->width * src->height * 2)) return(-1);
 	
-	/* YUYV and UYVY and VYUY are very similar and so  *
-	 * are all handled by this one function. */
-	
 	ptr = (uint8_t *) src->img;
 	z = 0;
 	
@@ -39,41 +125,13 @@ int fswc_add_image_yuyv(src_t *src, avgbmp_t *abitmap)
 	{
 		for(x = 0; x < src->width; x++)
 		{
-			int r, g, b;
-			int y, u, v;
+			int rgb[3];
 			
-			if(src->palette == SRC_PAL_UYVY)
-			{
-				if(!z) y = ptr[1] << 8;
-				else   y = ptr[3] << 8;
-				
-				u = ptr[0] - 128;
-				v = ptr[2] - 128;
-			}
-			else if(src->palette == SRC_PAL_YUYV)
-			{
-				if(!z) y = ptr[0] << 8;
-				else   y = ptr[2] << 8;
-				
-				u = ptr[1] - 128;
-				v = ptr[3] - 128;
-			}
-			else if(src->palette == SRC_PAL_VYUY)
-			{
-				if(!z) y = ptr[1] << 8;
-				else   y = ptr[3] << 8;
-
-				u = ptr[2] - 128;
-				v = ptr[0] - 128;
-			}
-			
-			r = (y + (359 * v)) >> 8;
-			g = (y - (88 * u) - (183 * v)) >> 8;
-			b = (y + (454 * u)) >> 8;
+			fswc_yuyv_rgb(ptr, z, src->palette, rgb);
 			
-			*(abitmap++) += CLIP(r, 0x00, 0xFF);
-			*(abitmap++) += CLIP(g, 0x00, 0xFF);
-			*(abitmap++) += CLIP(b, 0x00, 0xFF);
+			*(abitmap++) += rgb[0];
+			*(abitmap++) += rgb[1];
+			*(abitmap++) += rgb[2];
 			
 			if(z++)
 			{
@@ -88,40 +146,54 @@ int fswc_add_image_yuyv(src_t *src, avgbmp_t *abitmap)
 
 int fswc_add_image_yuv420p(src_t *src, avgbmp_t *abitmap)
 {
-	uint8_t *yptr, *uptr, *vptr;
-	uint32_t x, y, p;
-	
-	if(src->length < (src->width * src->height * 3) / 2) return(-1);
+	fswc_planes_t p;
+	uint32_t x, y;
 	
-	/* Setup pointers to Y, U and V buffers. */
-	yptr = (uint8_t *) src->img;
-	uptr = yptr + (src->width * src->height);
-	vptr = uptr + (src->width * src->height / 4);
-	p = 0;
+	if(fswc_yuv420p_planes(src, &p)) return(-1);
 	
 	for(y = 0; y < src->height; y++)
 	{
+		uint8_t *yrow = p.y + p.ystride * y;
+		uint8_t *urow = p.u + p.cstride * (y / 2);
+		uint8_t *vrow = p.v + p.cstride * (y / 2);
+		
 		for(x = 0; x < src->width; x++)
 		{
-			int r, g, b;
-			int y, u, v;
+			int rgb[3];
 			
-			y = *(yptr++) << 8;
-			u = uptr[p] - 128;
-			v = vptr[p] - 128;
+			fswc_yuv_rgb(yrow[x], urow[x / 2], vrow[x / 2], rgb);
 			
-			r = (y + (359 * v)) >> 8;
-			g = (y - (88 * u) - (183 * v)) >> 8;
-			b = (y + (454 * u)) >> 8;
+			*(abitmap++) += rgb[0];
+			*(abitmap++) += rgb[1];
+			*(abitmap++) += rgb[2];
+		}
+	}
+	
+	return(0);
+}
+
+int fswc_add_image_nv12(src_t *src, avgbmp_t *abitmap)
+{
+	fswc_planes_t p;
+	uint32_t x, y;
+	
+	if(fswc_nv12_planes(src, &p)) return(-1);
+	
+	for(y = 0; y < src->height; y++)
+	{
+		uint8_t *yrow = p.y + p.ystride * y;
+		uint8_t *crow = p.u + p.cstride * (y * p.cheight / src->height);
+		
+		for(x = 0; x < src->width; x++)
+		{
+			int rgb[3];
 			
-			*(abitmap++) += CLIP(r, 0x00, 0xFF);
-			*(abitmap++) += CLIP(g, 0x00, 0xFF);
-			*(abitmap++) += CLIP(b, 0x00, 0xFF);
+			fswc_yuv_rgb(yrow[x], crow[x & ~1], crow[x | 1], rgb);
 			
-			if(x & 1) p++;
+			*(abitmap++) += rgb[0];
+			*(abitmap++) += rgb[1];
+			*(abitmap++) += rgb[2];
 		}
-		
-		if(!(y & 1)) p -= src->width / 2;
 	}
 	
 	return(0);
@@ -141,8 +213,7 @@ int fswc_add_image_nv12mb(src_t *src, avgbmp_t *abitmap)
 		for(x = 0; x < src->width; x++)
 		{
 			uint32_t bx, by;
-			int cy, cu, cv;
-			int cr, cg, cb;
+			int rgb[3];
 			uint8_t *py, *puv;
 			
 			bx = x >> 4;
@@ -158,20 +229,49 @@ int fswc_add_image_nv12mb(src_t *src, avgbmp_t *abitmap)
 			puv += ((by * bw) + bx) * 0x100;
 			puv += (((y / 2) - (by << 4)) * 0x10) + ((x - (bx << 4)) &~ 1);
 			
-			cy = *py << 8;
-			cu = puv[0] - 128;
-			cv = puv[1] - 128;
-			
-			cr = (cy + (359 * cv)) >> 8;
-			cg = (cy - (88 * cu) - (183 * cv)) >> 8;
-			cb = (cy + (454 * cu)) >> 8;
+			fswc_yuv_rgb(*py, puv[0], puv[1], rgb);
 			
-			*(abitmap++) += CLIP(cr, 0x00, 0xFF);
-			*(abitmap++) += CLIP(cg, 0x00, 0xFF);
-			*(abitmap++) += CLIP(cb, 0x00, 0xFF);
+			*(abitmap++) += rgb[0];
+			*(abitmap++) += rgb[1];
+			*(abitmap++) += rgb[2];
 		}
 	}
 	
 	return(0);
 }
 
+int fswc_sample_yuv(src_t *src, uint32_t x, uint32_t y, int *rgb)
+{
+	fswc_planes_t p;
+	uint32_t i = y * src->width + x;
+	uint8_t *crow;
+	
+	/* The same as the decoders above, for just the one pixel. */
+	switch(src->palette)
+	{
+	case SRC_PAL_YUYV:
+	case SRC_PAL_UYVY:
+	case SRC_PAL_VYUY:
+		if(src->length < (src->width * src->height * 2)) return(-1);
+		fswc_yuyv_rgb((uint8_t *) src->img + (i & ~1) * 2, i & 1,
+		              src->palette, rgb);
+		return(0);
+	
+	case SRC_PAL_YUV420P:
+		if(fswc_yuv420p_planes(src, &p)) return(-1);
+		fswc_yuv_rgb(p.y[p.ystride * y + x],
+		             p.u[p.cstride * (y / 2) + x / 2],
+		             p.v[p.cstride * (y / 2) + x / 2], rgb);
+		return(0);
+	
+	case SRC_PAL_NV12:
+	case SRC_PAL_NV16:
+		if(fswc_nv12_planes(src, &p)) return(-1);
+		crow = p.u + p.cstride * (y * p.cheight / src->height);
+		fswc_yuv_rgb(p.y[p.ystride * y + x], crow[x & ~1], crow[x | 1], rgb);
+		return(0);
+	}
+	
+	return(-1);
+}
+
@@ -0,0 +1,198 @@
+/* fswebcam - FireStorm.cx's webcam generator                 */
+/*============================================================*/
+/* Copyright (C)2005-2011 Philip Heron <phil@sanslogic.co.uk> */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "dmabuf.h"
+#include "log.h"
+
+#define DMABUF_MAX_CLIENTS (16)
+
+static int dmabuf_fd = -1;
+static char *dmabuf_path = NULL;
+static int dmabuf_client[DMABUF_MAX_CLIENTS];
+static int dmabuf_clients = 0;
+
+/* Sources capturing in other threads share the one socket. */
+static pthread_mutex_t dmabuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dmabuf_shutdown(void);
+
+static int dmabuf_listen(char *path)
+{
+	struct sockaddr_un addr;
+	
+	/* The socket stays open for the life of the process. */
+	if(dmabuf_fd >= 0)
+	{
+		if(!strcmp(path, dmabuf_path)) return(0);
+		dmabuf_shutdown();
+	}
+	
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		ERROR("Socket path is too long: %s", path);
+		return(-1);
+	}
+	
+	dmabuf_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(dmabuf_fd < 0)
+	{
+		ERROR("socket: %s", strerror(errno));
+		return(-1);
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	/* Remove any socket left behind by a previous run. */
+	unlink(path);
+	
+	if(bind(dmabuf_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	   listen(dmabuf_fd, DMABUF_MAX_CLIENTS) == -1)
+	{
+		ERROR("Unable to listen on %s", path);
+		ERROR("bind: %s", strerror(errno));
+		close(dmabuf_fd);
+		dmabuf_fd = -1;
+		return(-1);
+	}
+	
+	dmabuf_path = strdup(path);
+	
+	MSG("Exporting frames on %s.", path);
+	
+	return(0);
+}
+
+static int dmabuf_send_frame(src_t *src)
+{
+	dmabuf_frame_t frame;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	int i, fd;
+	
+	if(dmabuf_fd < 0 || src->dmabuf_fd < 0) return(0);
+	
+	/* Accept any new clients. */
+	while(dmabuf_clients < DMABUF_MAX_CLIENTS)
+	{
+		fd = accept(dmabuf_fd, NULL, NULL);
+		if(fd < 0) break;
+		
+		/* Don't pass the client on to --exec commands. */
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		
+		DEBUG("New dmabuf client.");
+		dmabuf_client[dmabuf_clients++] = fd;
+	}
+	
+	if(!dmabuf_clients) return(0);
+	
+	memset(&frame, 0, sizeof(frame));
+	frame.sequence = src->sequence;
+	frame.palette  = src->palette;
+	frame.width    = src->width;
+	frame.height   = src->height;
+	frame.length   = src->length;
+	frame.tv_sec   = src->tv_last.tv_sec;
+	frame.tv_usec  = src->tv_last.tv_usec;
+	
+	iov.iov_base = &frame;
+	iov.iov_len  = sizeof(frame);
+	
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+	
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &src->dmabuf_fd, sizeof(int));
+	
+	for(i = 0; i < dmabuf_clients; i++)
+	{
+		if(sendmsg(dmabuf_client[i], &msg,
+		           MSG_NOSIGNAL | MSG_DONTWAIT) != -1) continue;
+		
+		/* A client that isn't keeping up misses the frame. */
+		if(errno == EAGAIN) continue;
+		
+		/* Drop clients that have gone away. */
+		DEBUG("dmabuf client gone: %s", strerror(errno));
+		close(dmabuf_client[i]);
+		dmabuf_client[i--] = dmabuf_client[--dmabuf_clients];
+	}
+	
+	return(0);
+}
+
+static void dmabuf_shutdown(void)
+{
+	while(dmabuf_clients) close(dmabuf_client[--dmabuf_clients]);
+	
+	if(dmabuf_fd >= 0)
+	{
+		close(dmabuf_fd);
+		unlink(dmabuf_path);
+	}
+	
+	free(dmabuf_path);
+	dmabuf_path = NULL;
+	dmabuf_fd = -1;
+}
+
+int dmabuf_open(char *path)
+{
+	int r;
+	
+	pthread_mutex_lock(&dmabuf_lock);
+	r = dmabuf_listen(path);
+	pthread_mutex_unlock(&dmabuf_lock);
+	
+	return(r);
+}
+
+int dmabuf_send(src_t *src)
+{
+	int r;
+	
+	if(src->dmabuf_fd < 0) return(0);
+	
+	pthread_mutex_lock(&dmabuf_lock);
+	r = dmabuf_send_frame(src);
+	pthread_mutex_unlock(&dmabuf_lock);
+	
+	return(r);
+}
+
+void dmabuf_close(void)
+{
+	pthread_mutex_lock(&dmabuf_lock);
+	dmabuf_shutdown();
+	pthread_mutex_unlock(&dmabuf_lock);
+}
+
@@ -0,0 +1,36 @@
+/* fswebcam - FireStorm.cx's webcam generator                 */
+/*============================================================*/
+/* Copyright (C)2005-2011 Philip Heron <phil@sanslogic.co.uk> */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#include <stdint.h>
+#include "src.h"
+
+#ifndef INC_DMABUF_H
+#define INC_DMABUF_H
+
+/* Each captured frame is sent to every connected client as one
+ * SOCK_SEQPACKET message containing this header, with the frame's
+ * dmabuf file descriptor attached as SCM_RIGHTS. The buffer will be
+ * reused by the device once fswebcam grabs the next frame. */
+
+typedef struct {
+	uint32_t sequence;
+	uint32_t palette;
+	uint32_t width;
+	uint32_t height;
+	uint32_t length;
+	int64_t  tv_sec;
+	int64_t  tv_usec;
+} dmabuf_frame_t;
+
+extern int dmabuf_open(char *path);
+extern int dmabuf_send(src_t *src);
+extern void dmabuf_close(void);
+
+#endif
+
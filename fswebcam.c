@@ -21,11 +21,17 @@
 #include <gd.h>
 #include <errno.h>
 #include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <glob.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "fswebcam.h"
 #include "log.h"
 #include "src.h"
+#include "dmabuf.h"
+#include "record.h"
+#include "ring.h"
 #include "dec.h"
 #include "effects.h"
 #include "parse.h"
@@ -96,6 +102,26 @@ enum fswc_options {
 	OPT_EXEC,
 	OPT_DUMPFRAME,
 	OPT_FPS,
+	OPT_PERSISTENT,
+	OPT_STANDBY,
+	OPT_SYNC,
+	OPT_CYCLE,
+	OPT_BUFFERS,
+	OPT_FRESH,
+	OPT_USERPTR,
+	OPT_DMABUF,
+	OPT_RECORD,
+	OPT_REALTIME,
+	OPT_RING,
+	OPT_CACHE,
+	OPT_SETTLE,
+	OPT_AUTO_MODE,
+	OPT_PALETTE_POLICY,
+	OPT_PALETTE_COSTS,
+	OPT_BENCHMARK_PALETTES,
+	OPT_FRAME_RANGE,
+	OPT_BATCH,
+	OPT_WORKERS,
 };
 
 typedef struct {
@@ -117,8 +143,32 @@ typedef struct {
 typedef struct {
 	uint16_t id;
 	char    *options;
+	int16_t  input; /* The --cycle input it is for, or -1 for all */
 } fswebcam_job_t;
 
+typedef struct {
+	char *name;
+	unsigned long frequency; /* 0 to use --frequency */
+	int skipframes;          /* -1 to use --skip */
+} fswebcam_input_t;
+
+typedef struct {
+	
+	char *name;
+	
+	/* The open source when running a persistent session. */
+	src_t *src;
+	
+	/* The result of the last capture. */
+	uint32_t width;
+	uint32_t height;
+	uint32_t frames;
+	avgbmp_t *abitmap;
+	struct timeval start;
+	char cropped;
+	
+} fswebcam_device_t;
+
 typedef struct {
 	
 	/* General options. */
@@ -130,26 +180,66 @@ typedef struct {
 	char *logfile;
 	char gmt;
 	
-	/* Capture start time. */
-	time_t start;
+	/* Capture start time, and the number of the
+	 * device the image being processed came from. */
+	struct timeval start;
+	unsigned int device_number;
+	
+	/* Batch mode: the files to process, the number of threads to
+	 * process them with and the name of the current file. */
+	char *batch;
+	unsigned int workers;
+	char *batch_name;
 	
 	/* Device options. */
-	char *device;
+	uint8_t devices;
+	fswebcam_device_t **device;
 	char *input;
 	unsigned char tuner;
 	unsigned long frequency;
+	
+	/* Inputs to capture from in turn, and the one being captured. */
+	uint8_t inputs;
+	fswebcam_input_t **input_list;
+	uint8_t input_number;
+	
 	unsigned long delay;
 	unsigned long timeout;
 	char use_read;
+	char use_userptr;
+	unsigned int buffers;
+	char fresh;
+	char *dmabuf;
+	char *record;
+	char realtime;
+	char *cache;
+	uint32_t frame_first;
+	uint32_t frame_last;
+	uint32_t frame_step;
+	unsigned int ring;
+	char ring_drop;
 	uint8_t list;
+	char persistent;
+	char standby;
+	
+	/* Use the frame taken closest to this time, if sync is set.
+	 * sync_time is zero unless a time was given to --sync. */
+	char sync;
+	struct timeval sync_time;
+	struct timeval sync_target;
 	
 	/* Image capture options. */
 	int width;
 	int height;
 	unsigned int frames;
 	unsigned int fps;
+	char auto_mode;
 	unsigned int skipframes;
+	float settle;
+	float settle_max;
 	int palette;
+	uint8_t palette_policy;
+	char *benchmark;
 	src_option_t **option;
 	char *dumpframe;
 	
@@ -157,6 +247,17 @@ typedef struct {
 	uint8_t jobs;
 	fswebcam_job_t **job;
 	
+	/* A crop the device is asked to do, and the job it replaces. */
+	int crop_job;
+	uint32_t crop_width;
+	uint32_t crop_height;
+	int32_t crop_x;
+	int32_t crop_y;
+	
+	/* The size of the image after --scale, if it's the first change. */
+	uint32_t scale_width;
+	uint32_t scale_height;
+	
 	/* Banner options. */
 	char banner;
 	uint32_t bg_colour;
@@ -181,6 +282,39 @@ typedef struct {
 	
 } fswebcam_config_t;
 
+typedef struct {
+	fswebcam_config_t *config;
+	fswebcam_device_t *device;
+	pthread_t thread;
+	int r;
+} fswebcam_capture_t;
+
+typedef struct {
+	fswebcam_config_t *config;
+	pthread_t thread;
+	
+	/* Shared by all the workers. */
+	char **input;
+	uint32_t inputs;
+	uint32_t *next;
+	uint32_t *failed;
+	pthread_mutex_t *lock;
+} fswebcam_worker_t;
+
+typedef struct {
+	src_t src;     /* A copy of the source describing the frame */
+	void *buffer;  /* The frame data, returned to the pool when done */
+	size_t length;
+} fswebcam_frame_t;
+
+typedef struct {
+	fswebcam_config_t *config;
+	src_t *src;
+	ring_t ring;
+	pthread_t thread;
+	int r;
+} fswebcam_reader_t;
+
 volatile char received_sigusr1 = 0;
 volatile char received_sighup  = 0;
 volatile char received_sigterm = 0;
@@ -225,8 +359,82 @@ int fswc_setup_signals()
 	return(0);
 }
 
+char *fswc_input_name(fswebcam_config_t *config)
+{
+	if(!config->inputs) return(NULL);
+	return(config->input_list[config->input_number]->name);
+}
+
+unsigned long fswc_input_frequency(fswebcam_config_t *config)
+{
+	fswebcam_input_t *input;
+	
+	if(!config->inputs) return(config->frequency);
+	
+	input = config->input_list[config->input_number];
+	return(input->frequency ? input->frequency : config->frequency);
+}
+
+char *fswc_expand_tokens(fswebcam_config_t *config, char *src,
+                         struct timeval *timestamp)
+{
+	char *dst, *d, *n;
+	size_t l;
+	
+	/* Each token expands to no more than three characters,
+	 * or the name of the input file or input. */
+	l = 3;
+	if(config->batch_name && strlen(config->batch_name) * 2 > l)
+		l = strlen(config->batch_name) * 2;
+	if(config->inputs && strlen(fswc_input_name(config)) * 2 > l)
+		l = strlen(fswc_input_name(config)) * 2;
+	
+	dst = malloc(strlen(src) / 2 * l + 2);
+	if(!dst) return(NULL);
+	
+	for(d = dst; *src; src++)
+	{
+		if(*src != '%' || !src[1])
+		{
+			*(d++) = *src;
+			continue;
+		}
+		
+		switch(*(++src))
+		{
+		case 'L': /* Milliseconds */
+			d += sprintf(d, "%03i", (int) (timestamp->tv_usec / 1000));
+			break;
+		case 'v': /* Device number */
+			d += sprintf(d, "%i", config->device_number % 1000);
+			break;
+		case 'f': /* Input file name, in batch mode */
+		case 'i': /* Input name, when cycling through inputs */
+			n = (*src == 'f' ? config->batch_name : fswc_input_name(config));
+			if(!n) break;
+			
+			/* Stop strftime() reading any % in the name. */
+			for(; *n; n++)
+			{
+				if(*n == '%') *(d++) = '%';
+				*(d++) = *n;
+			}
+			
+			break;
+		default: /* Leave anything else for strftime() */
+			*(d++) = '%';
+			*(d++) = *src;
+			break;
+		}
+	}
+	
+	*d = '\0';
+	
+	return(dst);
+}
+
 char *fswc_strftime(char *dst, size_t max, char *src,
-                    time_t timestamp, int gmt)
+                    struct timeval *timestamp, fswebcam_config_t *config)
 {
 	struct tm tm_timestamp;
 	
@@ -235,26 +443,34 @@ char *fswc_strftime(char *dst, size_t max, char *src,
 	if(!src) return(dst);
 	
 	/* Set the time structure. */
-	if(gmt) gmtime_r(&timestamp, &tm_timestamp);
-	else localtime_r(&timestamp, &tm_timestamp);
+	if(config->gmt) gmtime_r(&timestamp->tv_sec, &tm_timestamp);
+	else localtime_r(&timestamp->tv_sec, &tm_timestamp);
 	
 	/* Create the string */
+	src = fswc_expand_tokens(config, src, timestamp);
+	if(!src) return(dst);
+	
 	strftime(dst, max, src, &tm_timestamp);
+	free(src);
 	
 	return(dst);
 }
 
-char *fswc_strduptime(char *src, time_t timestamp, int gmt)
+char *fswc_strduptime(char *format, struct timeval *timestamp,
+                      fswebcam_config_t *config)
 {
 	struct tm tm_timestamp;
-	char *dst;
+	char *src, *dst;
 	size_t l;
 	
-	if(!src) return(NULL);
+	if(!format) return(NULL);
 	
 	/* Set the time structure. */
-	if(gmt) gmtime_r(&timestamp, &tm_timestamp);
-	else localtime_r(&timestamp, &tm_timestamp);
+	if(config->gmt) gmtime_r(&timestamp->tv_sec, &tm_timestamp);
+	else localtime_r(&timestamp->tv_sec, &tm_timestamp);
+	
+	src = fswc_expand_tokens(config, format, timestamp);
+	if(!src) return(NULL);
 	
 	dst = NULL;
 	l = strlen(src) * 2;
@@ -267,7 +483,7 @@ char *fswc_strduptime(char *src, time_t timestamp, int gmt)
 		if(!t)
 		{
 			free(dst);
-			return(NULL);
+			break;
 		}
 		
 		dst = t;
@@ -275,12 +491,17 @@ char *fswc_strduptime(char *src, time_t timestamp, int gmt)
 		*dst = 1;
 		r = strftime(dst, l, src, &tm_timestamp);
 		
-		if(r > 0 && r < l) return(dst);
-		if(r == 0 && *dst == '\0') return(dst);
+		if((r > 0 && r < l) || (r == 0 && *dst == '\0'))
+		{
+			free(src);
+			return(dst);
+		}
 		
 		l *= 2;
 	}
 	
+	free(src);
+	
 	return(NULL);
 }
 
@@ -367,7 +588,7 @@ int fswc_draw_banner(fswebcam_config_t *config, gdImage *image)
 	
 	/* Create the timestamp text. */
 	fswc_strftime(timestamp, 200, config->timestamp,
-	              config->start, config->gmt);
+	              &config->start, config);
 	
 	/* Calculate the position and height of the banner. */
 	spacing = 4;
@@ -454,7 +675,7 @@ int fswc_output(fswebcam_config_t *config, char *name, gdImage *image)
 	}
 	
 	fswc_strftime(filename, FILENAME_MAX, name,
-	              config->start, config->gmt);
+	              &config->start, config);
 	
 	/* Create a temporary image buffer. */
 	im = fswc_gdImageDuplicate(image);
@@ -532,7 +753,7 @@ int fswc_exec(fswebcam_config_t *config, char *cmd)
 	char *cmdline;
 	FILE *p;
 	
-	cmdline = fswc_strduptime(cmd, config->start, config->gmt);
+	cmdline = fswc_strduptime(cmd, &config->start, config);
 	if(!cmdline) return(-1);
 	
 	MSG("Executing '%s'...", cmdline);
@@ -564,196 +785,955 @@ int fswc_exec(fswebcam_config_t *config, char *cmd)
 	return(0);
 }
 
-int fswc_grab(fswebcam_config_t *config)
+src_t *fswc_open_source(fswebcam_config_t *config, fswebcam_device_t *device)
 {
-	uint32_t frame;
-	uint32_t x, y;
-	avgbmp_t *abitmap, *pbitmap;
-	gdImage *image, *original;
-	uint8_t modified;
-	src_t src;
+	src_t *src;
+	int i;
 	
-	/* Record the start time. */
-	config->start = time(NULL);
+	src = calloc(sizeof(src_t), 1);
+	if(!src)
+	{
+		ERROR("Out of memory.");
+		return(NULL);
+	}
 	
 	/* Set source options... */
-	memset(&src, 0, sizeof(src));
-	src.input      = config->input;
-	src.tuner      = config->tuner;
-	src.frequency  = config->frequency;
-	src.delay      = config->delay;
-	src.timeout    = config->timeout; 
-	src.use_read   = config->use_read;
-	src.list       = config->list;
-	src.palette    = config->palette;
-	src.width      = config->width;
-	src.height     = config->height;
-	src.fps        = config->fps;
-	src.option     = config->option;
-	
-	HEAD("--- Opening %s...", config->device);
-	
-	if(src_open(&src, config->device) == -1) return(-1);
+	src->input      = config->input;
+	src->tuner      = config->tuner;
+	src->frequency  = config->frequency;
+	src->delay      = config->delay;
+	src->timeout    = config->timeout; 
+	src->use_read   = config->use_read;
+	src->use_userptr = config->use_userptr;
+	src->buffers    = config->buffers;
+	src->fresh      = config->fresh;
+	src->dmabuf     = config->dmabuf;
+	src->record     = config->record;
+	src->realtime   = config->realtime;
+	src->cache      = config->cache;
+	src->frame_first = config->frame_first;
+	src->frame_last  = config->frame_last;
+	src->frame_step  = config->frame_step;
+	src->list       = config->list;
+	src->palette    = config->palette;
+	src->palette_policy = config->palette_policy;
+	src->width      = config->width;
+	src->height     = config->height;
+	src->fps        = config->fps;
+	src->auto_mode  = config->auto_mode;
+	src->option     = config->option;
+	src->crop_width  = config->crop_width;
+	src->crop_height = config->crop_height;
+	src->crop_x      = config->crop_x;
+	src->crop_y      = config->crop_y;
+	
+	/* Start with the current input, when cycling through them. */
+	if(config->inputs)
+	{
+		src->input     = fswc_input_name(config);
+		src->frequency = fswc_input_frequency(config);
+	}
 	
-	/* The source may have adjusted the width and height we passed
-	 * to it. Update the main config to match. */
-	config->width  = src.width;
-	config->height = src.height;
+	/* Capture no more than is needed for the scaled image. */
+	if(config->auto_mode && config->scale_width)
+	{
+		src->width  = config->scale_width;
+		src->height = config->scale_height;
+	}
 	
-	/* Allocate memory for the average bitmap buffer. */
-	abitmap = calloc(config->width * config->height * 3, sizeof(avgbmp_t));
-	if(!abitmap)
+	HEAD("--- Opening %s...", device->name);
+	
+	/* Batch inputs are file names, which may contain a ':'. */
+	if(config->batch_name) i = src_open_path(src, device->name);
+	else i = src_open(src, device->name);
+	
+	if(i == -1)
 	{
-		ERROR("Out of memory.");
-		return(-1);
+		free(src);
+		return(NULL);
 	}
 	
-	if(config->frames == 1) HEAD("--- Capturing frame...");
-	else HEAD("--- Capturing %i frames...", config->frames);
+	/* Keep the source open between captures if requested, or
+	 * while cycling through the inputs. */
+	if(config->persistent || config->inputs) device->src = src;
+	
+	return(src);
+}
+
+int fswc_close_source(fswebcam_device_t *device, src_t *src)
+{
+	src_close(src);
+	free(src);
 	
-	if(config->skipframes == 1) MSG("Skipping frame...");
-	else if(config->skipframes > 1) MSG("Skipping %i frames...", config->skipframes);
+	if(device->src == src) device->src = NULL;
 	
-	/* Grab (and do nothing with) the skipped frames. */
-	for(frame = 0; frame < config->skipframes; frame++)
-		if(src_grab(&src) == -1) break;
+	return(0);
+}
+
+int fswc_strdiff(char *a, char *b)
+{
+	if(!a || !b) return(a != b);
+	return(strcmp(a, b));
+}
+
+int fswc_controls_changed(fswebcam_config_t *a, fswebcam_config_t *b)
+{
+	src_option_t **oa, **ob;
 	
-	/* If frames where skipped, inform when normal capture begins. */
-	if(config->skipframes) MSG("Capturing %i frames...", config->frames);
+	/* Compare the control values. */
+	oa = a->option;
+	ob = b->option;
 	
-	/* Grab the requested number of frames. */
-	for(frame = 0; frame < config->frames; frame++)
+	if(!oa || !ob) return(oa != ob);
+	
+	for(; *oa && *ob; oa++, ob++)
+	{
+		if(fswc_strdiff((*oa)->name, (*ob)->name)) return(-1);
+		if(fswc_strdiff((*oa)->value, (*ob)->value)) return(-1);
+	}
+	
+	return(*oa != *ob);
+}
+
+int fswc_source_changed(fswebcam_config_t *a, fswebcam_config_t *b)
+{
+	if(fswc_strdiff(a->input, b->input)) return(-1);
+	if(a->tuner != b->tuner) return(-1);
+	if(a->frequency != b->frequency) return(-1);
+	if(a->delay != b->delay) return(-1);
+	if(a->use_read != b->use_read) return(-1);
+	if(a->use_userptr != b->use_userptr) return(-1);
+	if(a->buffers != b->buffers) return(-1);
+	if(fswc_strdiff(a->dmabuf, b->dmabuf)) return(-1);
+	if(a->frame_first != b->frame_first) return(-1);
+	if(a->frame_last != b->frame_last) return(-1);
+	if(a->frame_step != b->frame_step) return(-1);
+	if(a->realtime != b->realtime) return(-1);
+	if(a->palette != b->palette) return(-1);
+	if(a->palette_policy != b->palette_policy) return(-1);
+	if(a->width != b->width) return(-1);
+	if(a->height != b->height) return(-1);
+	if(a->fps != b->fps) return(-1);
+	if(a->auto_mode != b->auto_mode) return(-1);
+	if(a->scale_width != b->scale_width) return(-1);
+	if(a->scale_height != b->scale_height) return(-1);
+	if(a->crop_width != b->crop_width) return(-1);
+	if(a->crop_height != b->crop_height) return(-1);
+	if(a->crop_x != b->crop_x) return(-1);
+	if(a->crop_y != b->crop_y) return(-1);
+	
+	return(0);
+}
+
+int fswc_reload_source(fswebcam_config_t *old, fswebcam_config_t *config)
+{
+	int changed, controls;
+	uint8_t i, j;
+	
+	changed  = !config->persistent || fswc_source_changed(old, config);
+	controls = fswc_controls_changed(old, config);
+	
+	for(i = 0; i < old->devices; i++)
 	{
-		if(src_grab(&src) == -1) break;
+		src_t *src = old->device[i]->src;
 		
-		if(!frame && config->dumpframe)
+		if(!src) continue;
+		
+		/* Look for the same device in the new config. */
+		for(j = 0; j < config->devices; j++)
 		{
-			/* Dump the raw data from the first frame to file. */
-			FILE *f;
-			
-			MSG("Dumping raw frame to '%s'...", config->dumpframe);
-			
-			f = strcmp(config->dumpframe, "-") == 0 ? stdout : fopen(config->dumpframe, "wb");
+			if(config->device[j]->src) continue;
+			if(!strcmp(old->device[i]->name, config->device[j]->name)) break;
+		}
+		
+		if(changed || j == config->devices)
+		{
+			/* The source will be closed along with the old config,
+			 * and reopened with the new options on the next capture. */
+			MSG("Device options have changed. Closing %s.", old->device[i]->name);
+			continue;
+		}
+		
+		/* Move the open source over to the new config. */
+		old->device[i]->src    = NULL;
+		config->device[j]->src = src;
+		
+		src->input   = config->input;
+		src->option  = config->option;
+		src->timeout = config->timeout;
+		src->fresh   = config->fresh;
+		src->dmabuf  = config->dmabuf;
+		src->record  = config->record;
+		src->cache   = config->cache;
+		
+		/* Apply any new control values without reopening. */
+		if(controls && src_set_controls(src) == -1)
+		{
+			MSG("Unable to change controls. Closing %s.", old->device[i]->name);
 			
-			if(f == stdout && config->background)
-			{
-				ERROR("stdout is unavailable in background mode.");
-			}
-			else if(!f)
-			{
-				ERROR("fopen: %s", strerror(errno));
-			}
-			else
+			old->device[i]->src    = src;
+			config->device[j]->src = NULL;
+		}
+	}
+	
+	return(0);
+}
+
+int fswc_add_frame(src_t *src, avgbmp_t *abitmap)
+{
+	switch(src->palette)
+	{
+	case SRC_PAL_PNG:
+		fswc_add_image_png(src, abitmap);
+		break;
+	case SRC_PAL_JPEG:
+	case SRC_PAL_MJPEG:
+		fswc_add_image_jpeg(src, abitmap);
+		break;
+	case SRC_PAL_S561:
+		fswc_add_image_s561(abitmap, src->img, src->length, src->width, src->height, src->palette);
+		break;
+	case SRC_PAL_RGB32:
+		fswc_add_image_rgb32(src, abitmap);
+		break;
+	case SRC_PAL_BGR32:
+	case SRC_PAL_ABGR32:
+		fswc_add_image_bgr32(src, abitmap);
+		break;
+	case SRC_PAL_RGB24:
+		fswc_add_image_rgb24(src, abitmap);
+		break;
+	case SRC_PAL_BGR24:
+		fswc_add_image_bgr24(src, abitmap);
+		break;
+	case SRC_PAL_BAYER:
+	case SRC_PAL_SBGGR8:
+	case SRC_PAL_SRGGB8:
+	case SRC_PAL_SGBRG8:
+	case SRC_PAL_SGRBG8:
+		fswc_add_image_bayer(abitmap, src->img, src->length, src->width, src->height, src->palette);
+		break;
+	case SRC_PAL_YUYV:
+	case SRC_PAL_UYVY:
+	case SRC_PAL_VYUY:
+		fswc_add_image_yuyv(src, abitmap);
+		break;
+	case SRC_PAL_YUV420P:
+		fswc_add_image_yuv420p(src, abitmap);
+		break;
+	case SRC_PAL_NV12MB:
+		fswc_add_image_nv12mb(src, abitmap);
+		break;
+	case SRC_PAL_NV12:
+	case SRC_PAL_NV16:
+		fswc_add_image_nv12(src, abitmap);
+		break;
+	case SRC_PAL_RGB565:
+		fswc_add_image_rgb565(src, abitmap);
+		break;
+	case SRC_PAL_RGB555:
+		fswc_add_image_rgb555(src, abitmap);
+		break;
+	case SRC_PAL_Y16:
+		fswc_add_image_y16(src, abitmap);
+		break;
+	case SRC_PAL_GREY:
+		fswc_add_image_grey(src, abitmap);
+		break;
+	}
+	
+	return(0);
+}
+
+/* Frames sampled in each direction when measuring a frame. */
+#define SETTLE_SAMPLES (32)
+
+/* Frames in a row that must be within the tolerance. */
+#define SETTLE_FRAMES (3)
+
+typedef struct {
+	float y, r, g, b;
+} fswebcam_stats_t;
+
+int fswc_sample_pixel(src_t *src, uint32_t x, uint32_t y, int *rgb)
+{
+	switch(src->palette)
+	{
+	case SRC_PAL_BAYER:
+	case SRC_PAL_SBGGR8:
+	case SRC_PAL_SRGGB8:
+	case SRC_PAL_SGBRG8:
+	case SRC_PAL_SGRBG8:
+		return(fswc_sample_bayer(src->img, src->length, src->width, src->height, src->palette, x, y, rgb));
+	case SRC_PAL_YUYV:
+	case SRC_PAL_UYVY:
+	case SRC_PAL_VYUY:
+	case SRC_PAL_YUV420P:
+	case SRC_PAL_NV12:
+	case SRC_PAL_NV16:
+		return(fswc_sample_yuv(src, x, y, rgb));
+	case SRC_PAL_RGB32:
+	case SRC_PAL_BGR32:
+	case SRC_PAL_ABGR32:
+	case SRC_PAL_RGB24:
+	case SRC_PAL_BGR24:
+	case SRC_PAL_RGB565:
+	case SRC_PAL_RGB555:
+		return(fswc_sample_rgb(src, x, y, rgb));
+	case SRC_PAL_Y16:
+	case SRC_PAL_GREY:
+		return(fswc_sample_grey(src, x, y, rgb));
+	}
+	
+	/* Compressed images and the rest have to be decoded in full. */
+	return(-1);
+}
+
+int fswc_frame_stats(src_t *src, avgbmp_t *abitmap, fswebcam_stats_t *stats)
+{
+	uint32_t x, y, dx, dy, n;
+	uint32_t r, g, b;
+	avgbmp_t *p;
+	int rgb[3];
+	char decode;
+	
+	if(!src->width || !src->height) return(-1);
+	
+	dx = src->width  / SETTLE_SAMPLES;
+	dy = src->height / SETTLE_SAMPLES;
+	if(!dx) dx = 1;
+	if(!dy) dy = 1;
+	
+	/* Most frames can be sampled where they are. If the first pixel
+	 * can't be, the frame is decoded into the average bitmap and only
+	 * the sampled pixels are cleared again. The caller clears the rest. */
+	decode = (fswc_sample_pixel(src, 0, 0, rgb) != 0);
+	if(decode) fswc_add_frame(src, abitmap);
+	
+	r = g = b = n = 0;
+	
+	for(y = dy / 2; y < src->height; y += dy)
+		for(x = dx / 2; x < src->width; x += dx)
+		{
+			if(decode)
 			{
-				fwrite(src.img, 1, src.length, f);
-				if(f != stdout) fclose(f);
+				p = &abitmap[(y * src->width + x) * 3];
+				rgb[0] = p[0];
+				rgb[1] = p[1];
+				rgb[2] = p[2];
+				p[0] = p[1] = p[2] = 0;
 			}
+			else fswc_sample_pixel(src, x, y, rgb);
+			
+			r += rgb[0];
+			g += rgb[1];
+			b += rgb[2];
+			n++;
 		}
-		
-		/* Add frame to the average bitmap. */
-		switch(src.palette)
+	
+	if(!n) return(-1);
+	
+	stats->r = (float) r / n;
+	stats->g = (float) g / n;
+	stats->b = (float) b / n;
+	stats->y = 0.299 * stats->r + 0.587 * stats->g + 0.114 * stats->b;
+	
+	return(decode);
+}
+
+int fswc_stats_differ(fswebcam_stats_t *a, fswebcam_stats_t *b, float tolerance)
+{
+	if(a->y - b->y > tolerance || b->y - a->y > tolerance) return(-1);
+	if(a->r - b->r > tolerance || b->r - a->r > tolerance) return(-1);
+	if(a->g - b->g > tolerance || b->g - a->g > tolerance) return(-1);
+	if(a->b - b->b > tolerance || b->b - a->b > tolerance) return(-1);
+	
+	return(0);
+}
+
+int fswc_settle(fswebcam_config_t *config, src_t *src, avgbmp_t *abitmap)
+{
+	fswebcam_stats_t last, stats;
+	struct timeval start, elapsed;
+	uint32_t frame, stable;
+	float seconds;
+	int r = 0;
+	char decoded = 0;
+	
+	MSG("Waiting for the image to settle...");
+	
+	stable = 0;
+	seconds = 0;
+	
+	/* Keep skipping frames until the brightness and colour stop
+	 * changing, or the time limit passes. Time is measured
+	 * between the frame timestamps. */
+	for(frame = 0; stable < SETTLE_FRAMES; frame++)
+	{
+		if(src_grab(src) == -1 ||
+		   (r = fswc_frame_stats(src, abitmap, &stats)) == -1)
 		{
-		case SRC_PAL_PNG:
-			fswc_add_image_png(&src, abitmap);
-			break;
-		case SRC_PAL_JPEG:
-		case SRC_PAL_MJPEG:
-			fswc_add_image_jpeg(&src, abitmap);
+			r = -1;
 			break;
-		case SRC_PAL_S561:
-			fswc_add_image_s561(abitmap, src.img, src.length, src.width, src.height, src.palette);
-			break;
-		case SRC_PAL_RGB32:
-			fswc_add_image_rgb32(&src, abitmap);
-			break;
-		case SRC_PAL_BGR32:
-		case SRC_PAL_ABGR32:
-			fswc_add_image_bgr32(&src, abitmap);
-			break;
-		case SRC_PAL_RGB24:
-			fswc_add_image_rgb24(&src, abitmap);
-			break;
-		case SRC_PAL_BGR24:
-			fswc_add_image_bgr24(&src, abitmap);
-			break;
-		case SRC_PAL_BAYER:
-		case SRC_PAL_SBGGR8:
-		case SRC_PAL_SRGGB8:
-		case SRC_PAL_SGBRG8:
-		case SRC_PAL_SGRBG8:
-			fswc_add_image_bayer(abitmap, src.img, src.length, src.width, src.height, src.palette);
-			break;
-		case SRC_PAL_YUYV:
-		case SRC_PAL_UYVY:
-		case SRC_PAL_VYUY:
-			fswc_add_image_yuyv(&src, abitmap);
-			break;
-		case SRC_PAL_YUV420P:
-			fswc_add_image_yuv420p(&src, abitmap);
-			break;
-		case SRC_PAL_NV12MB:
-			fswc_add_image_nv12mb(&src, abitmap);
-			break;
-		case SRC_PAL_RGB565:
-			fswc_add_image_rgb565(&src, abitmap);
-			break;
-		case SRC_PAL_RGB555:
-			fswc_add_image_rgb555(&src, abitmap);
-			break;
-		case SRC_PAL_Y16:
-			fswc_add_image_y16(&src, abitmap);
-			break;
-		case SRC_PAL_GREY:
-			fswc_add_image_grey(&src, abitmap);
+		}
+		
+		if(r) decoded = 1;
+		
+		if(!frame) start = src->timestamp;
+		
+		timersub(&src->timestamp, &start, &elapsed);
+		seconds = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+		
+		if(frame && !fswc_stats_differ(&last, &stats, config->settle))
+			stable++;
+		else stable = 0;
+		
+		last = stats;
+		
+		if(config->settle_max && seconds >= config->settle_max)
+		{
+			WARN("Image did not settle after %.2f seconds (%i frames).",
+			     seconds, frame + 1);
 			break;
 		}
 	}
 	
-	/* We are now finished with the capture card. */
-	src_close(&src);
+	/* Clear anything decoded while measuring the frames. */
+	if(decoded)
+		memset(abitmap, 0, src->width * src->height * 3 * sizeof(avgbmp_t));
 	
-	/* Fail if no frames where captured. */
-	if(!frame)
+	if(r == -1) return(-1);
+	
+	if(stable == SETTLE_FRAMES)
+		MSG("Image settled after %.2f seconds (%i frames).", seconds, frame);
+	
+	return(0);
+}
+
+int fswc_benchmark_palettes(fswebcam_config_t *config)
+{
+	struct timespec start, now;
+	avgbmp_t *abitmap;
+	gdImage *im;
+	uint8_t *raw, *jpeg, *png;
+	int jlength, plength;
+	uint32_t i, n, pixels;
+	double ns;
+	src_t src;
+	FILE *f;
+	int p;
+	
+	HEAD("--- Measuring the palette decoders at %ix%i...",
+	     config->width, config->height);
+	
+	pixels  = config->width * config->height;
+	abitmap = calloc(pixels * 3, sizeof(avgbmp_t));
+	raw     = malloc(pixels * 4);
+	im      = gdImageCreateTrueColor(config->width, config->height);
+	
+	if(!abitmap || !raw || !im)
 	{
-		ERROR("No frames captured.");
+		ERROR("Out of memory.");
 		free(abitmap);
+		free(raw);
+		if(im) gdImageDestroy(im);
 		return(-1);
 	}
 	
-	HEAD("--- Processing captured image...");
+	/* A noisy test image, in every format the decoders take. */
+	srand(1);
+	for(i = 0; i < pixels * 4; i++) raw[i] = rand();
+	for(i = 0; i < pixels; i++)
+		gdImageSetPixel(im, i % config->width, i / config->width,
+		                (raw[i * 3] << 16) | (raw[i * 3 + 1] << 8) |
+		                raw[i * 3 + 2]);
 	
-	/* Copy the average bitmap image to a gdImage. */
-	original = gdImageCreateTrueColor(config->width, config->height);
-	if(!original)
+	jpeg = gdImageJpegPtr(im, &jlength, 90);
+	png  = gdImagePngPtr(im, &plength);
+	gdImageDestroy(im);
+	
+	f = fopen(config->benchmark, "wt");
+	if(!f)
 	{
-		ERROR("Out of memory.");
+		ERROR("Unable to write palette costs to %s", config->benchmark);
+		ERROR("fopen: %s", strerror(errno));
 		free(abitmap);
+		free(raw);
+		gdFree(jpeg);
+		gdFree(png);
 		return(-1);
 	}
 	
-	pbitmap = abitmap;
-	for(y = 0; y < config->height; y++)
-		for(x = 0; x < config->width; x++)
+	fprintf(f, "# fswebcam palette decode times, ns per pixel at %ix%i\n",
+	        config->width, config->height);
+	
+	for(p = 0; src_palette[p].name; p++)
+	{
+		memset(&src, 0, sizeof(src));
+		src.palette = p;
+		src.width   = config->width;
+		src.height  = config->height;
+		src.img     = raw;
+		src.length  = src_palette[p].bytes * pixels;
+		
+		if(p == SRC_PAL_JPEG || p == SRC_PAL_MJPEG)
 		{
-			int px = x;
-			int py = y;
+			src.img    = jpeg;
+			src.length = jlength;
+		}
+		else if(p == SRC_PAL_PNG)
+		{
+			src.img    = png;
+			src.length = plength;
+		}
+		else if(p == SRC_PAL_S561)
+		{
+			/* Compressed, and there is no encoder. */
+			continue;
+		}
+		
+		if(!src.img) continue;
+		
+		/* Decode for at least a quarter of a second. */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		
+		n = 0;
+		do
+		{
+			fswc_add_frame(&src, abitmap);
+			memset(abitmap, 0, pixels * 3 * sizeof(avgbmp_t));
+			n++;
+			
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ns  = (now.tv_sec - start.tv_sec) * 1e9;
+			ns += now.tv_nsec - start.tv_nsec;
+		}
+		while(ns < 250000000);
+		
+		ns /= (double) n * pixels;
+		
+		MSG("%-8s %6.2f ns per pixel", src_palette[p].name, ns);
+		fprintf(f, "%s %.3f\n", src_palette[p].name, ns);
+	}
+	
+	fclose(f);
+	free(abitmap);
+	free(raw);
+	gdFree(jpeg);
+	gdFree(png);
+	
+	MSG("Saved palette costs to %s", config->benchmark);
+	
+	return(0);
+}
+
+fswebcam_frame_t *fswc_hold_frame(src_t *src)
+{
+	fswebcam_frame_t *held;
+	
+	held = malloc(sizeof(fswebcam_frame_t));
+	if(!held)
+	{
+		ERROR("Out of memory.");
+		return(NULL);
+	}
+	
+	held->src = *src;
+	
+	if(src->planes > 1)
+	{
+		uint8_t p;
+		uint8_t *d;
+		
+		/* Copy the planes into one buffer. */
+		held->length = 0;
+		for(p = 0; p < src->planes; p++)
+			held->length += src->plane_length[p];
+		
+		held->buffer = src_pool_alloc(held->length);
+		
+		for(d = held->buffer, p = 0; d && p < src->planes; p++)
+		{
+			memcpy(d, src->plane[p], src->plane_length[p]);
+			held->src.plane[p] = d;
+			d += src->plane_length[p];
+		}
+	}
+	else
+	{
+		/* Take the buffer from the source, or a copy of it. A
+		 * buffer taken is returned to the pool at its full size. */
+		held->length = (src->pooled ? src->img_size : src->length);
+		held->buffer = src_detach(src);
+	}
+	
+	if(!held->buffer)
+	{
+		ERROR("Out of memory.");
+		free(held);
+		return(NULL);
+	}
+	
+	held->src.img = (src->planes > 1 ? held->src.plane[0] : held->buffer);
+	
+	return(held);
+}
+
+void fswc_release_frame(fswebcam_frame_t *held)
+{
+	src_pool_free(held->buffer, held->length);
+	free(held);
+}
+
+/* The distance in seconds between two times. */
+#define TV_SECONDS(a, b) (((a).tv_sec - (b).tv_sec) + \
+                          ((a).tv_usec - (b).tv_usec) / 1000000.0)
+
+fswebcam_frame_t *fswc_select_frame(fswebcam_config_t *config, src_t *src)
+{
+	fswebcam_frame_t *best = NULL, *held;
+	struct timeval wall, now;
+	struct timespec ts;
+	double target, error, best_error = 0;
+	
+	/* Frames are timed on the monotonic clock. Work out
+	 * how far the target is from now on that clock. */
+	gettimeofday(&wall, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	now.tv_sec  = ts.tv_sec;
+	now.tv_usec = ts.tv_nsec / 1000;
+	target = TV_SECONDS(config->sync_target, wall);
+	
+	/* Hold on to each frame until one comes after the target,
+	 * then keep whichever of the last two is closest to it. */
+	while(1)
+	{
+		if(src_grab(src) == -1) break;
+		
+		error = TV_SECONDS(src->timestamp, now) - target;
+		
+		if(!best || error < 0 || error < -best_error)
+		{
+			if(!(held = fswc_hold_frame(src))) break;
+			
+			if(best) fswc_release_frame(best);
+			best = held;
+			best_error = error;
+		}
+		
+		if(error >= 0) break;
+	}
+	
+	if(best) MSG("Using the frame taken %+.1f ms from the target.",
+	             best_error * 1000);
+	
+	return(best);
+}
+
+void *fswc_reader_thread(void *arg)
+{
+	fswebcam_reader_t *reader = (fswebcam_reader_t *) arg;
+	fswebcam_config_t *config = reader->config;
+	uint32_t frame = 0;
+	
+	reader->r = 0;
+	
+	while(frame < config->frames)
+	{
+		fswebcam_frame_t *held;
+		
+		if(src_grab(reader->src) == -1 ||
+		   !(held = fswc_hold_frame(reader->src)))
+		{
+			reader->r = -1;
+			break;
+		}
+		
+		/* Wait for room in the ring, or drop the frame. */
+		if(ring_push(&reader->ring, held, !config->ring_drop))
+		{
+			fswc_release_frame(held);
+			reader->src->dropped_frames++;
+			continue;
+		}
+		
+		frame++;
+	}
+	
+	ring_close(&reader->ring);
+	
+	return(NULL);
+}
+
+fswebcam_reader_t *fswc_start_reader(fswebcam_config_t *config, src_t *src)
+{
+	fswebcam_reader_t *reader;
+	
+	reader = calloc(sizeof(fswebcam_reader_t), 1);
+	if(!reader)
+	{
+		ERROR("Out of memory.");
+		return(NULL);
+	}
+	
+	reader->config = config;
+	reader->src    = src;
+	
+	if(ring_init(&reader->ring, config->ring))
+	{
+		free(reader);
+		return(NULL);
+	}
+	
+	if(pthread_create(&reader->thread, NULL, fswc_reader_thread, reader))
+	{
+		WARN("Unable to start capture thread.");
+		ring_free(&reader->ring);
+		free(reader);
+		return(NULL);
+	}
+	
+	return(reader);
+}
+
+int fswc_stop_reader(fswebcam_reader_t *reader)
+{
+	fswebcam_frame_t *held;
+	int r;
+	
+	pthread_join(reader->thread, NULL);
+	r = reader->r;
+	
+	/* Release anything left in the ring. */
+	while((held = ring_pop(&reader->ring, 0))) fswc_release_frame(held);
+	
+	ring_free(&reader->ring);
+	free(reader);
+	
+	return(r);
+}
+
+int fswc_capture(fswebcam_config_t *config, fswebcam_device_t *device)
+{
+	uint32_t frame;
+	avgbmp_t *abitmap;
+	fswebcam_reader_t *reader = NULL;
+	fswebcam_frame_t *first = NULL;
+	unsigned int skipframes = config->skipframes;
+	src_t *src;
+	
+	/* Record the start time. This is replaced with the
+	 * time of the first frame once it has been captured. */
+	gettimeofday(&device->start, NULL);
+	
+	/* Reuse the source if a persistent session is already open. */
+	src = device->src;
+	if(!src && !(src = fswc_open_source(config, device))) return(-1);
+	
+	/* Bring a persistent session back up to speed. */
+	src_standby(src, 0);
+	
+	/* Change to the next input, when cycling through them. */
+	if(config->inputs)
+	{
+		fswebcam_input_t *input = config->input_list[config->input_number];
+		
+		/* Reopen the device if it can't change while open. */
+		if(src_set_input(src, input->name, fswc_input_frequency(config)))
+		{
+			fswc_close_source(device, src);
+			if(!(src = fswc_open_source(config, device))) return(-1);
+		}
+		
+		if(input->skipframes >= 0) skipframes = input->skipframes;
+	}
+	
+	/* Frames captured before this point are stale. */
+	src_trigger(src);
+	
+	/* The source may have adjusted the width and height we passed
+	 * to it. Keep a copy as the source may be closed before use. */
+	device->width   = src->width;
+	device->height  = src->height;
+	device->cropped = src->cropped;
+	
+	/* Allocate memory for the average bitmap buffer. */
+	abitmap = calloc(device->width * device->height * 3, sizeof(avgbmp_t));
+	if(!abitmap)
+	{
+		ERROR("Out of memory.");
+		fswc_close_source(device, src);
+		return(-1);
+	}
+	
+	if(config->frames == 1) HEAD("--- Capturing frame...");
+	else HEAD("--- Capturing %i frames...", config->frames);
+	
+	if(skipframes == 1) MSG("Skipping frame...");
+	else if(skipframes > 1) MSG("Skipping %i frames...", skipframes);
+	
+	/* Grab (and do nothing with) the skipped frames. */
+	for(frame = 0; frame < skipframes; frame++)
+		if(src_grab(src) == -1) break;
+	
+	/* Skip more frames until the image has settled, if requested.
+	 * Give up if the source failed, it may not be usable. */
+	if(frame < skipframes ||
+	   (config->settle && fswc_settle(config, src, abitmap) == -1))
+	{
+		ERROR("No frames captured.");
+		fswc_close_source(device, src);
+		free(abitmap);
+		return(-1);
+	}
+	
+	/* If frames where skipped, inform when normal capture begins. */
+	if(skipframes || config->settle)
+		MSG("Capturing %i frames...", config->frames);
+	
+	/* Pick the first frame by when it was taken, if requested. */
+	if(config->sync) first = fswc_select_frame(config, src);
+	
+	/* Dequeue the frames in another thread if requested, so the
+	 * device isn't kept waiting while each frame is decoded. */
+	if(config->ring && config->frames > 1 && (first || !config->sync))
+		reader = fswc_start_reader(config, src);
+	
+	/* Grab the requested number of frames. */
+	for(frame = 0; frame < config->frames; frame++)
+	{
+		fswebcam_frame_t *held = NULL;
+		src_t *f = src;
+		
+		if(!frame && config->sync)
+		{
+			if(!(held = first)) break;
+			f = &held->src;
+		}
+		else if(reader)
+		{
+			if(!(held = ring_pop(&reader->ring, 1))) break;
+			f = &held->src;
+		}
+		else if(src_grab(src) == -1) break;
+		
+		if(!frame) device->start = f->wallclock;
+		
+		/* Only the first device dumps a frame, so
+		 * devices in other threads don't share the file. */
+		if(!frame && config->dumpframe && device == config->device[0])
+		{
+			/* Dump the raw data from the first frame to file. */
+			FILE *d;
+			
+			MSG("Dumping raw frame to '%s'...", config->dumpframe);
+			
+			d = strcmp(config->dumpframe, "-") == 0 ? stdout : fopen(config->dumpframe, "wb");
+			
+			if(d == stdout && config->background)
+			{
+				ERROR("stdout is unavailable in background mode.");
+			}
+			else if(!d)
+			{
+				ERROR("fopen: %s", strerror(errno));
+			}
+			else
+			{
+				fwrite(f->img, 1, f->length, d);
+				if(d != stdout) fclose(d);
+			}
+		}
+		
+		/* Add frame to the average bitmap. */
+		fswc_add_frame(f, abitmap);
+		
+		if(held) fswc_release_frame(held);
+	}
+	
+	/* Wait for the capture thread to finish. */
+	if(reader) fswc_stop_reader(reader);
+	
+	/* We are now finished with the capture card, unless the session
+	 * is being kept open. Close it anyway if the capture failed so
+	 * the device is reopened next time. */
+	if(src == device->src && frame == config->frames)
+	{
+		src_show_stats(src);
+		
+		/* Keep the device streaming slowly until the next
+		 * capture, once the last input has been captured. */
+		if(config->standby && config->input_number + 1 >= config->inputs &&
+		   src_standby(src, -1))
+			DEBUG("Unable to slow the device down between captures.");
+	}
+	else fswc_close_source(device, src);
+	
+	/* Fail if no frames where captured. */
+	if(!frame)
+	{
+		ERROR("No frames captured.");
+		free(abitmap);
+		return(-1);
+	}
+	
+	device->frames  = frame;
+	device->abitmap = abitmap;
+	
+	return(0);
+}
+
+void *fswc_capture_thread(void *arg)
+{
+	fswebcam_capture_t *capture = (fswebcam_capture_t *) arg;
+	
+	capture->r = fswc_capture(capture->config, capture->device);
+	
+	return(NULL);
+}
+
+int fswc_process(fswebcam_config_t *config, fswebcam_device_t *device)
+{
+	uint32_t x, y;
+	avgbmp_t *pbitmap;
+	gdImage *image, *original;
+	uint8_t modified;
+	
+	if(config->devices == 1) HEAD("--- Processing captured image...");
+	else HEAD("--- Processing image from %s...", device->name);
+	
+	config->start = device->start;
+	
+	/* Copy the average bitmap image to a gdImage. */
+	original = gdImageCreateTrueColor(device->width, device->height);
+	if(!original)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	pbitmap = device->abitmap;
+	for(y = 0; y < device->height; y++)
+		for(x = 0; x < device->width; x++)
+		{
+			int px = x;
+			int py = y;
 			int colour;
 			
-			colour  = (*(pbitmap++) / config->frames) << 16;
-			colour += (*(pbitmap++) / config->frames) << 8;
-			colour += (*(pbitmap++) / config->frames);
+			colour  = (*(pbitmap++) / device->frames) << 16;
+			colour += (*(pbitmap++) / device->frames) << 8;
+			colour += (*(pbitmap++) / device->frames);
 			
 			gdImageSetPixel(original, px, py, colour);
 		}
 	
-	free(abitmap);
-	
 	/* Make a copy of the original image. */
 	image = fswc_gdImageDuplicate(original);
 	if(!image)
 	{
 		ERROR("Out of memory.");
-		gdImageDestroy(image);
+		gdImageDestroy(original);
 		return(-1);
 	}
 	
@@ -792,6 +1772,10 @@ int fswc_grab(fswebcam_config_t *config)
 		uint16_t id   = config->job[x]->id;
 		char *options = config->job[x]->options;
 		
+		/* Skip jobs for the other inputs. */
+		if(config->job[x]->input != -1 &&
+		   config->job[x]->input != config->input_number) continue;
+		
 		switch(id)
 		{
 		case 1: /* A non-option argument: a filename. */
@@ -813,6 +1797,10 @@ int fswc_grab(fswebcam_config_t *config)
 			break;
 		case OPT_CROP:
 			modified = 1;
+			
+			/* Skip it if the device has already done the crop. */
+			if((int) x == config->crop_job && device->cropped) break;
+			
 			image = fx_crop(image, options);
 			break;
 		case OPT_SCALE:
@@ -991,6 +1979,94 @@ int fswc_grab(fswebcam_config_t *config)
 	return(0);
 }
 
+int fswc_grab_devices(fswebcam_config_t *config)
+{
+	fswebcam_capture_t *capture;
+	uint8_t i;
+	int r = 0;
+	
+	capture = calloc(config->devices, sizeof(fswebcam_capture_t));
+	if(!capture)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	/* Capture from each device at the same time. The
+	 * first device is captured in this thread. */
+	for(i = 0; i < config->devices; i++)
+	{
+		capture[i].config = config;
+		capture[i].device = config->device[i];
+		capture[i].r      = -1;
+		
+		if(!i) continue;
+		
+		if(pthread_create(&capture[i].thread, NULL,
+		                  fswc_capture_thread, &capture[i]))
+		{
+			ERROR("Unable to start capture thread for %s.",
+			      config->device[i]->name);
+			capture[i].device = NULL;
+		}
+	}
+	
+	if(config->devices) fswc_capture_thread(&capture[0]);
+	
+	for(i = 1; i < config->devices; i++)
+		if(capture[i].device) pthread_join(capture[i].thread, NULL);
+	
+	/* Process the images one device at a time. */
+	for(i = 0; i < config->devices; i++)
+	{
+		fswebcam_device_t *device = config->device[i];
+		
+		if(capture[i].r) r = -1;
+		if(!device->abitmap) continue;
+		
+		config->device_number = i;
+		if(fswc_process(config, device)) r = -1;
+		
+		free(device->abitmap);
+		device->abitmap = NULL;
+	}
+	
+	free(capture);
+	
+	return(r);
+}
+
+int fswc_grab(fswebcam_config_t *config)
+{
+	uint8_t i;
+	int r = 0;
+	
+	if(!config->inputs) return(fswc_grab_devices(config));
+	
+	/* Capture and process an image from each input in turn,
+	 * keeping the devices open until the last one is done. */
+	for(i = 0; i < config->inputs; i++)
+	{
+		config->input_number = i;
+		
+		HEAD("--- Capturing from input \"%s\"...", fswc_input_name(config));
+		
+		if(fswc_grab_devices(config)) r = -1;
+	}
+	
+	config->input_number = 0;
+	
+	if(config->persistent) return(r);
+	
+	for(i = 0; i < config->devices; i++)
+	{
+		fswebcam_device_t *device = config->device[i];
+		if(device->src) fswc_close_source(device, device->src);
+	}
+	
+	return(r);
+}
+
 int fswc_openlog(fswebcam_config_t *config)
 {
 	char *s;
@@ -1127,17 +2203,37 @@ int fswc_usage()
 	       " -t, --tuner <number>         Selects the tuner to use.\n"
 	       "     --list-tuners            Displays available tuners.\n"
 	       " -f, --frequency <number>     Selects the frequency use.\n"
+	       "     --cycle <input>          Adds an input to capture from in turn.\n"
 	       " -p, --palette <name>         Selects the palette format to use.\n"
+	       "     --palette-policy <name>  Picks a palette by speed, size or quality.\n"
+	       "     --palette-costs <file>   Loads the palette decode times.\n"
+	       "     --benchmark-palettes <file> Measures the palette decode times.\n"
 	       " -D, --delay <number>         Sets the pre-capture delay time. (seconds)\n"
 	       " -r, --resolution <size>      Sets the capture resolution.\n"
 	       "     --fps <framerate>        Sets the capture frame rate.\n"
 	       "     --list-framesizes        Displays the available frame sizes.\n"
 	       "     --list-framerates        Displays the available frame rates.\n"
+	       "     --auto-mode              Pick the best frame size and rate.\n"
 	       " -F, --frames <number>        Sets the number of frames to capture.\n"
 	       " -T, --timeout <seconds>      Sets the timeout for frame capture.\n"
 	       " -S, --skip <number>          Sets the number of frames to skip.\n"
+	       "     --settle <level>[,<max>] Skip frames until the image settles.\n"
 	       "     --dumpframe <filename>   Dump a raw frame to file.\n"
 	       " -R, --read                   Use read() to capture images.\n"
+	       "     --userptr                Capture into buffers allocated by fswebcam.\n"
+	       "     --buffers <number>       Sets the number of capture buffers.\n"
+	       "     --persistent             Keep the device open in loop mode.\n"
+	       "     --standby                Stream slowly between persistent captures.\n"
+	       "     --sync[=<time>]          Use the frame taken closest to the due time.\n"
+	       "     --fresh                  Discard frames captured before the trigger.\n"
+	       "     --dmabuf <socket>        Share captured frames on a Unix socket.\n"
+	       "     --record <filename>      Record every captured frame to file.\n"
+	       "     --realtime               Replay a recording at the speed it was made.\n"
+	       "     --cache <directory>      Cache the device's formats and controls.\n"
+	       "     --ring <frames>[,drop]   Capture frames in a separate thread.\n"
+	       "     --frame-range <first>[,<last>[,<step>]] Frames to read from a raw file.\n"
+	       "     --batch <files>          Process each file in a directory, pattern or @list.\n"
+	       "     --workers <number>       Sets the number of threads used by --batch.\n"
 	       "     --list-formats           Displays the available capture formats.\n"
 	       " -s, --set <name>=<value>     Sets a control value.\n"
 	       "     --list-controls          Displays the available controls.\n"
@@ -1184,57 +2280,483 @@ int fswc_usage()
 	return(0);
 }
 
-int fswc_add_job(fswebcam_config_t *config, uint16_t id, char *options)
+int fswc_add_job(fswebcam_config_t *config, uint16_t id, char *options)
+{
+	fswebcam_job_t *job;
+	void *n;
+	
+	job = malloc(sizeof(fswebcam_job_t));
+	if(!job)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	job->id = id;
+	if(options) job->options = strdup(options);
+	else job->options = NULL;
+	
+	/* Jobs given after --cycle are only for that input. */
+	job->input = (int16_t) config->inputs - 1;
+	
+	/* Increase the size of the job queue. */
+	n = realloc(config->job, sizeof(fswebcam_job_t *) * (config->jobs + 1));
+	if(!n)
+	{
+		ERROR("Out of memory.");
+		
+		if(job->options) free(job->options);
+		free(job);
+		
+		return(-1);
+	}
+	
+	config->job = n;
+	
+	/* Add the new job to the queue. */
+	config->job[config->jobs++] = job;
+	
+	return(0);
+}
+
+int fswc_add_device(fswebcam_config_t *config, char *name)
+{
+	fswebcam_device_t *device;
+	void *n;
+	
+	if(config->devices == 0xFF)
+	{
+		ERROR("Too many devices.");
+		return(-1);
+	}
+	
+	device = calloc(sizeof(fswebcam_device_t), 1);
+	if(!device)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	device->name = strdup(name);
+	
+	/* Increase the size of the device list. */
+	n = realloc(config->device, sizeof(fswebcam_device_t *) * (config->devices + 1));
+	if(!n || !device->name)
+	{
+		ERROR("Out of memory.");
+		
+		free(device->name);
+		free(device);
+		
+		return(-1);
+	}
+	
+	config->device = n;
+	
+	/* Add the new device to the list. */
+	config->device[config->devices++] = device;
+	
+	return(0);
+}
+
+int fswc_free_devices(fswebcam_config_t *config)
+{
+	int i;
+	
+	/* Close any open sources and free the memory. */
+	for(i = 0; i < config->devices; i++)
+	{
+		fswebcam_device_t *device = config->device[i];
+		
+		if(device->src) fswc_close_source(device, device->src);
+		
+		free(device->abitmap);
+		free(device->name);
+		free(device);
+	}
+	
+	free(config->device);
+	config->device = NULL;
+	config->devices = 0;
+	
+	return(0);
+}
+
+int fswc_add_input(fswebcam_config_t *config, char *options)
+{
+	fswebcam_input_t *input;
+	char *s;
+	void *n;
+	
+	if(config->inputs == 0xFF)
+	{
+		ERROR("Too many inputs.");
+		return(-1);
+	}
+	
+	input = calloc(sizeof(fswebcam_input_t), 1);
+	if(!input)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	/* The input, and optionally the frames to
+	 * skip and the frequency to tune it to. */
+	input->name = argdup(options, ",", 0, ARG_NO_TRIM);
+	input->skipframes = -1;
+	
+	if(input->name && !*input->name)
+	{
+		ERROR("No input name given: %s", options);
+		
+		free(input->name);
+		free(input);
+		
+		return(-1);
+	}
+	
+	s = argdup(options, ",", 1, ARG_NO_TRIM);
+	if(s && *s) input->skipframes = atoi(s);
+	free(s);
+	
+	s = argdup(options, ",", 2, ARG_NO_TRIM);
+	if(s && *s) input->frequency = atof(s) * 1000;
+	free(s);
+	
+	/* Increase the size of the input list. */
+	n = realloc(config->input_list, sizeof(fswebcam_input_t *) * (config->inputs + 1));
+	if(!n || !input->name)
+	{
+		ERROR("Out of memory.");
+		
+		free(input->name);
+		free(input);
+		
+		return(-1);
+	}
+	
+	config->input_list = n;
+	
+	/* Add the new input to the list. */
+	config->input_list[config->inputs++] = input;
+	
+	return(0);
+}
+
+int fswc_free_inputs(fswebcam_config_t *config)
+{
+	int i;
+	
+	for(i = 0; i < config->inputs; i++)
+	{
+		free(config->input_list[i]->name);
+		free(config->input_list[i]);
+	}
+	
+	free(config->input_list);
+	config->input_list = NULL;
+	config->inputs = 0;
+	
+	return(0);
+}
+
+int fswc_free_jobs(fswebcam_config_t *config)
+{
+	int i;
+	
+	/* Scan through all the jobs and free the memory. */
+	for(i = 0; i < config->jobs; i++)
+	{
+		if(config->job[i]->options) free(config->job[i]->options);
+		free(config->job[i]);
+	}
+	
+	/* Free the job queue, set settings to zero. */
+	free(config->job);
+	config->job = NULL;
+	config->jobs = 0;
+	
+	return(0);
+}
+
+int fswc_set_ring(fswebcam_config_t *config, char *options)
+{
+	char *policy;
+	long frames;
+	
+	frames = argtol(options, ",", 0, 0, 10);
+	if(frames < 0)
+	{
+		WARN("Bad ring size: %s", options);
+		frames = 0;
+	}
+	
+	config->ring = frames;
+	config->ring_drop = 0;
+	
+	/* Wait for room in the ring by default, or drop frames. */
+	policy = argdup(options, ",", 1, 0);
+	if(!policy) return(0);
+	
+	if(!strcasecmp(policy, "drop")) config->ring_drop = -1;
+	else if(strcasecmp(policy, "wait")) WARN("Unknown ring policy: %s", policy);
+	
+	free(policy);
+	
+	return(0);
+}
+
+int fswc_first_change(fswebcam_config_t *config)
+{
+	int i;
+	
+	/* Find the first job that uses or changes the captured image.
+	 * Returns -1 if there is none, or the original is needed. */
+	for(i = 0; i < config->jobs; i++)
+		if(config->job[i]->id == OPT_REVERT) return(-1);
+	
+	for(i = 0; i < config->jobs; i++)
+	{
+		switch(config->job[i]->id)
+		{
+		case 1:
+		case OPT_SAVE:
+		case OPT_FLIP:
+		case OPT_CROP:
+		case OPT_SCALE:
+		case OPT_ROTATE:
+		case OPT_DEINTERLACE:
+		case OPT_INVERT:
+		case OPT_GREYSCALE:
+		case OPT_SWAPCHANNELS:
+			/* The device can't do it for only one input. */
+			if(config->job[i]->input != -1) return(-1);
+			return(i);
+		}
+	}
+	
+	return(-1);
+}
+
+int fswc_find_crop(fswebcam_config_t *config)
+{
+	char arg[32];
+	char *options;
+	int w, h;
+	
+	config->crop_job    = -1;
+	config->crop_width  = 0;
+	config->crop_height = 0;
+	config->crop_x      = -1;
+	config->crop_y      = -1;
+	
+	/* The device can only do the crop if it is the first change made
+	 * to the image, and the original image is never needed. */
+	config->crop_job = fswc_first_change(config);
+	if(config->crop_job != -1 &&
+	   config->job[config->crop_job]->id != OPT_CROP) config->crop_job = -1;
+	
+	if(config->crop_job == -1) return(0);
+	
+	/* Read the area as fx_crop() does. Leave it to
+	 * fx_crop() to report any problem with it. */
+	options = config->job[config->crop_job]->options;
+	
+	w = h = -1;
+	if(!argncpy(arg, 32, options, ", \t", 0, 0))
+	{
+		w = argtol(arg, "x ", 0, 0, 10);
+		h = argtol(arg, "x ", 1, 0, 10);
+	}
+	
+	if(w <= 0 || h <= 0)
+	{
+		config->crop_job = -1;
+		return(0);
+	}
+	
+	config->crop_width  = w;
+	config->crop_height = h;
+	
+	if(!argncpy(arg, 32, options, ", \t", 1, 0))
+	{
+		config->crop_x = argtol(arg, "x ", 0, 0, 10);
+		config->crop_y = argtol(arg, "x ", 1, 0, 10);
+	}
+	
+	return(0);
+}
+
+int fswc_find_scale(fswebcam_config_t *config)
+{
+	char *options;
+	int i, w, h;
+	
+	config->scale_width  = 0;
+	config->scale_height = 0;
+	
+	/* Only a scale done before any other change is useful. */
+	i = fswc_first_change(config);
+	if(i == -1 || config->job[i]->id != OPT_SCALE) return(0);
+	
+	options = config->job[i]->options;
+	
+	w = argtol(options, "x ", 0, 0, 10);
+	h = argtol(options, "x ", 1, 0, 10);
+	
+	if(w <= 0 || h <= 0) return(0);
+	
+	config->scale_width  = w;
+	config->scale_height = h;
+	
+	return(0);
+}
+
+int fswc_set_frame_range(fswebcam_config_t *config, char *options)
 {
-	fswebcam_job_t *job;
-	void *n;
+	long first, last, step;
 	
-	job = malloc(sizeof(fswebcam_job_t));
-	if(!job)
+	first = argtol(options, ",", 0, 0, 10);
+	last  = argtol(options, ",", 1, 0, 10);
+	step  = argtol(options, ",", 2, 0, 10);
+	
+	if(first < 0 || (last >= 0 && last < first))
 	{
-		ERROR("Out of memory.");
+		ERROR("Bad frame range: %s", options);
 		return(-1);
 	}
 	
-	job->id = id;
-	if(options) job->options = strdup(options);
-	else job->options = NULL;
+	config->frame_first = first;
+	config->frame_last  = last >= 0 ? last : SRC_FRAME_END;
+	config->frame_step  = step > 0 ? step : 1;
 	
-	/* Increase the size of the job queue. */
-	n = realloc(config->job, sizeof(fswebcam_job_t *) * (config->jobs + 1));
-	if(!n)
+	return(0);
+}
+
+int fswc_set_sync(fswebcam_config_t *config, char *options)
+{
+	struct tm tm;
+	time_t now;
+	double t;
+	char *end;
+	int year, mon, mday, hour = 0, min = 0, sec = 0, n = 0, day = 0;
+	
+	config->sync = -1;
+	
+	/* Without a time the target is the next second, or the due time. */
+	if(!options) return(0);
+	
+	/* Seconds since the epoch, or a local date and time. */
+	t = strtod(options, &end);
+	if(!*options || *end)
 	{
-		ERROR("Out of memory.");
+		now = time(NULL);
+		localtime_r(&now, &tm);
 		
-		if(job->options) free(job->options);
-		free(job);
+		if(sscanf(options, "%d-%d-%d %d:%d:%d%n", &year, &mon, &mday,
+		   &hour, &min, &sec, &n) == 6 && !options[n])
+		{
+			tm.tm_year = year - 1900;
+			tm.tm_mon  = mon - 1;
+			tm.tm_mday = mday;
+		}
+		else
+		{
+			/* Just a time of day, with or without the seconds. */
+			n = 0;
+			if(sscanf(options, "%d:%d:%d%n", &hour, &min, &sec, &n) != 3 ||
+			   options[n])
+			{
+				sec = n = 0;
+				sscanf(options, "%d:%d%n", &hour, &min, &n);
+				if(options[n]) n = 0;
+			}
+			
+			day = (n != 0);
+		}
+		
+		tm.tm_hour  = hour;
+		tm.tm_min   = min;
+		tm.tm_sec   = sec;
+		tm.tm_isdst = -1;
 		
+		t = (n ? mktime(&tm) : -1);
+		
+		/* A time of day that has passed is taken to be tomorrow's. */
+		if(day && t <= now)
+		{
+			tm.tm_mday++;
+			tm.tm_isdst = -1;
+			t = mktime(&tm);
+		}
+	}
+	
+	if(t <= 0)
+	{
+		ERROR("Bad sync time: %s", options);
 		return(-1);
 	}
 	
-	config->job = n;
+	config->sync_time.tv_sec  = (time_t) t;
+	config->sync_time.tv_usec = (t - (time_t) t) * 1000000;
 	
-	/* Add the new job to the queue. */
-	config->job[config->jobs++] = job;
+	return(0);
+}
+
+int fswc_set_timeout(fswebcam_config_t *config, char *options)
+{
+	double ms = atof(options) * 1000;
+	
+	if(ms < 0)
+	{
+		ERROR("Bad timeout: %s", options);
+		return(-1);
+	}
+	
+	/* 0 waits forever, so don't round anything else down to it. */
+	if(ms > 0 && ms < 1) ms = 1;
+	
+	config->timeout = ms;
 	
 	return(0);
 }
 
-int fswc_free_jobs(fswebcam_config_t *config)
+int fswc_set_policy(fswebcam_config_t *config, char *name)
 {
-	int i;
+	if(!strcasecmp(name, "fastest"))       config->palette_policy = SRC_POLICY_FASTEST;
+	else if(!strcasecmp(name, "smallest")) config->palette_policy = SRC_POLICY_SMALLEST;
+	else if(!strcasecmp(name, "quality"))  config->palette_policy = SRC_POLICY_QUALITY;
+	else if(!strcasecmp(name, "none"))     config->palette_policy = SRC_POLICY_NONE;
+	else
+	{
+		ERROR("Unrecognised palette policy \"%s\". Supported policies:", name);
+		ERROR("none, fastest, smallest, quality");
+		return(-1);
+	}
 	
-	/* Scan through all the jobs and free the memory. */
-	for(i = 0; i < config->jobs; i++)
+	return(0);
+}
+
+int fswc_set_settle(fswebcam_config_t *config, char *options)
+{
+	char *limit;
+	
+	config->settle = atof(options);
+	if(config->settle < 0)
 	{
-		if(config->job[i]->options) free(config->job[i]->options);
-		free(config->job[i]);
+		WARN("Bad settle tolerance: %s", options);
+		config->settle = 0;
 	}
 	
-	/* Free the job queue, set settings to zero. */
-	free(config->job);
-	config->job = NULL;
-	config->jobs = 0;
+	/* The time limit is optional. */
+	limit = argdup(options, ",", 1, 0);
+	if(!limit) return(0);
+	
+	config->settle_max = atof(limit);
+	if(config->settle_max < 0) config->settle_max = 0;
+	
+	free(limit);
 	
 	return(0);
 }
@@ -1356,6 +2878,7 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 {
 	int c;
 	fswc_getopt_t s;
+	char file_devices = 0, cmd_devices = 0;
 	static struct option long_opts[] =
 	{
 		{"help",            no_argument,       0, '?'},
@@ -1375,17 +2898,37 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 		{"tuner",           required_argument, 0, 't'},
 		{"list-tuners",     no_argument,       0, OPT_LIST_TUNERS},
 		{"frequency",       required_argument, 0, 'f'},
+		{"cycle",           required_argument, 0, OPT_CYCLE},
 		{"delay",           required_argument, 0, 'D'},
 		{"timeout",         required_argument, 0, 'T'},
 		{"resolution",      required_argument, 0, 'r'},
 		{"fps",	            required_argument, 0, OPT_FPS},
 		{"list-framesizes", no_argument,       0, OPT_LIST_FRAMESIZES},
 		{"list-framerates", no_argument,       0, OPT_LIST_FRAMERATES},
+		{"auto-mode",       no_argument,       0, OPT_AUTO_MODE},
 		{"frames",          required_argument, 0, 'F'},
 		{"skip",            required_argument, 0, 'S'},
+		{"settle",          required_argument, 0, OPT_SETTLE},
 		{"palette",         required_argument, 0, 'p'},
+		{"palette-policy",  required_argument, 0, OPT_PALETTE_POLICY},
+		{"palette-costs",   required_argument, 0, OPT_PALETTE_COSTS},
+		{"benchmark-palettes", required_argument, 0, OPT_BENCHMARK_PALETTES},
 		{"dumpframe",       required_argument, 0, OPT_DUMPFRAME},
 		{"read",            no_argument,       0, 'R'},
+		{"userptr",         no_argument,       0, OPT_USERPTR},
+		{"buffers",         required_argument, 0, OPT_BUFFERS},
+		{"persistent",      no_argument,       0, OPT_PERSISTENT},
+		{"standby",         no_argument,       0, OPT_STANDBY},
+		{"sync",            optional_argument, 0, OPT_SYNC},
+		{"fresh",           no_argument,       0, OPT_FRESH},
+		{"dmabuf",          required_argument, 0, OPT_DMABUF},
+		{"record",          required_argument, 0, OPT_RECORD},
+		{"realtime",        no_argument,       0, OPT_REALTIME},
+		{"ring",            required_argument, 0, OPT_RING},
+		{"frame-range",     required_argument, 0, OPT_FRAME_RANGE},
+		{"batch",           required_argument, 0, OPT_BATCH},
+		{"workers",         required_argument, 0, OPT_WORKERS},
+		{"cache",           required_argument, 0, OPT_CACHE},
 		{"list-formats",    no_argument,       0, OPT_LIST_FORMATS},
 		{"set",             required_argument, 0, 's'},
 		{"list-controls",   no_argument,       0, OPT_LIST_CONTROLS},
@@ -1446,25 +2989,61 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 	config->pidfile = NULL;
 	config->logfile = NULL;
 	config->gmt = 0;
-	config->start = 0;
-	config->device = strdup("/dev/video0");
+	timerclear(&config->start);
+	config->batch = NULL;
+	config->workers = 0;
+	config->batch_name = NULL;
+	config->devices = 0;
+	config->device = NULL;
 	config->input = NULL;
 	config->tuner = 0;
 	config->frequency = 0;
+	config->inputs = 0;
+	config->input_list = NULL;
+	config->input_number = 0;
 	config->delay = 0;
-	config->timeout = 10;
+	config->timeout = 10000;
 	config->use_read = 0;
+	config->use_userptr = 0;
+	config->buffers = 0;
+	config->fresh = 0;
+	config->dmabuf = NULL;
+	config->record = NULL;
+	config->realtime = 0;
+	config->cache = NULL;
+	config->ring = 0;
+	config->ring_drop = 0;
+	config->frame_first = 0;
+	config->frame_last = SRC_FRAME_END;
+	config->frame_step = 1;
 	config->list = 0;
+	config->persistent = 0;
+	config->standby = 0;
+	config->sync = 0;
+	config->sync_time.tv_sec  = 0;
+	config->sync_time.tv_usec = 0;
 	config->width = 384;
 	config->height = 288;
 	config->fps = 0;
+	config->auto_mode = 0;
 	config->frames = 1;
 	config->skipframes = 0;
+	config->settle = 0;
+	config->settle_max = 5;
 	config->palette = SRC_PAL_ANY;
+	config->palette_policy = SRC_POLICY_NONE;
+	config->benchmark = NULL;
 	config->option = NULL;
 	config->dumpframe = NULL;
 	config->jobs = 0;
 	config->job = NULL;
+	config->crop_job = -1;
+	config->crop_width = 0;
+	config->crop_height = 0;
+	config->crop_x = -1;
+	config->crop_y = -1;
+	config->scale_width = 0;
+	config->scale_height = 0;
 	
 	/* Don't report errors. */
 	opterr = 0;
@@ -1523,8 +3102,20 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 			config->logfile = strdup(optarg);
 			break;
 		case 'd':
-			if(config->device) free(config->device);
-			config->device = strdup(optarg);
+			/* Devices on the command line replace any from
+			 * the configuration file, whichever comes first. */
+			if(s.f)
+			{
+				if(cmd_devices) break;
+				file_devices = -1;
+			}
+			else
+			{
+				if(file_devices && !cmd_devices) fswc_free_devices(config);
+				cmd_devices = -1;
+			}
+			
+			fswc_add_device(config, optarg);
 			break;
 		case 'i':
 			if(config->input) free(config->input);
@@ -1542,11 +3133,14 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 		case 'f':
 			config->frequency = atof(optarg) * 1000;
 			break;
+		case OPT_CYCLE:
+			if(fswc_add_input(config, optarg)) return(-1);
+			break;
 		case 'D':
 			config->delay = atoi(optarg);
 			break;
 		case 'T':
-			config->timeout = atoi(optarg);
+			if(fswc_set_timeout(config, optarg)) return(-1);
 			break;
 		case 'r':
 	 		config->width  = argtol(optarg, "x ", 0, 0, 10);
@@ -1555,12 +3149,24 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 		case OPT_FPS:
 			config->fps = atoi(optarg);
 			break;
+		case OPT_LIST_FRAMESIZES:
+			config->list |= SRC_LIST_FRAMESIZES;
+			break;
+		case OPT_LIST_FRAMERATES:
+			config->list |= SRC_LIST_FRAMERATES;
+			break;
+		case OPT_AUTO_MODE:
+			config->auto_mode = -1;
+			break;
 		case 'F':
 			config->frames = atoi(optarg);
 			break;
 		case 'S':
 			config->skipframes = atoi(optarg);
 			break;
+		case OPT_SETTLE:
+			fswc_set_settle(config, optarg);
+			break;
 		case 's':
 			fswc_set_option(config, optarg);
 			break;
@@ -1571,9 +3177,65 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 			config->palette = fswc_find_palette(optarg);
 			if(config->palette == SRC_PAL_ANY) return(-1);
 			break;
+		case OPT_PALETTE_POLICY:
+			if(fswc_set_policy(config, optarg)) return(-1);
+			break;
+		case OPT_PALETTE_COSTS:
+			if(src_load_palette_costs(optarg)) return(-1);
+			break;
+		case OPT_BENCHMARK_PALETTES:
+			free(config->benchmark);
+			config->benchmark = strdup(optarg);
+			break;
 		case 'R':
 			config->use_read = -1;
 			break;
+		case OPT_USERPTR:
+			config->use_userptr = -1;
+			break;
+		case OPT_BUFFERS:
+			config->buffers = atoi(optarg);
+			break;
+		case OPT_PERSISTENT:
+			config->persistent = -1;
+			break;
+		case OPT_STANDBY:
+			config->standby = -1;
+			break;
+		case OPT_SYNC:
+			if(fswc_set_sync(config, optarg)) return(-1);
+			break;
+		case OPT_FRESH:
+			config->fresh = -1;
+			break;
+		case OPT_DMABUF:
+			free(config->dmabuf);
+			config->dmabuf = strdup(optarg);
+			break;
+		case OPT_RECORD:
+			free(config->record);
+			config->record = strdup(optarg);
+			break;
+		case OPT_REALTIME:
+			config->realtime = -1;
+			break;
+		case OPT_CACHE:
+			free(config->cache);
+			config->cache = strdup(optarg);
+			break;
+		case OPT_RING:
+			fswc_set_ring(config, optarg);
+			break;
+		case OPT_FRAME_RANGE:
+			if(fswc_set_frame_range(config, optarg)) return(-1);
+			break;
+		case OPT_BATCH:
+			free(config->batch);
+			config->batch = strdup(optarg);
+			break;
+		case OPT_WORKERS:
+			config->workers = atoi(optarg);
+			break;
 		case OPT_LIST_FORMATS:
 			config->list |= SRC_LIST_FORMATS;
 			break;
@@ -1591,6 +3253,14 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 		}
 	}
 	
+	/* Use the default device if none where given. */
+	if(!config->devices) fswc_add_device(config, "/dev/video0");
+	
+	/* See if the device can be asked to crop the image,
+	 * or capture a smaller one to be scaled. */
+	fswc_find_crop(config);
+	fswc_find_scale(config);
+	
 	/* Do a sanity check on the options. */
 	if(config->frequency < 0)       config->frequency = 0;
 	if(config->width < 1)           config->width = 1;
@@ -1616,12 +3286,19 @@ int fswc_getopts(fswebcam_config_t *config, int argc, char *argv[])
 
 int fswc_free_config(fswebcam_config_t *config)
 {
+	fswc_free_devices(config);
+	fswc_free_inputs(config);
+	
 	free(config->pidfile);
 	free(config->logfile);
-	free(config->device);
 	free(config->input);
 	
 	free(config->dumpframe);
+	free(config->dmabuf);
+	free(config->record);
+	free(config->cache);
+	free(config->benchmark);
+	free(config->batch);
         free(config->title);
 	free(config->subtitle);
 	free(config->timestamp);
@@ -1639,6 +3316,267 @@ int fswc_free_config(fswebcam_config_t *config)
 	return(0);
 }
 
+int fswc_batch_add(char ***input, uint32_t *inputs, char *name)
+{
+	char **n;
+	
+	n = realloc(*input, sizeof(char *) * (*inputs + 1));
+	if(!n || !(name = strdup(name)))
+	{
+		ERROR("Out of memory.");
+		if(n) *input = n;
+		return(-1);
+	}
+	
+	*input = n;
+	(*input)[(*inputs)++] = name;
+	
+	return(0);
+}
+
+int fswc_batch_cmp(const void *a, const void *b)
+{
+	return(strcmp(*(char **) a, *(char **) b));
+}
+
+int fswc_batch_inputs(fswebcam_config_t *config, char ***input, uint32_t *inputs)
+{
+	struct stat st;
+	
+	*input  = NULL;
+	*inputs = 0;
+	
+	if(*config->batch == '@')
+	{
+		char line[FILENAME_MAX];
+		FILE *f;
+		
+		/* A file listing one input on each line. */
+		f = fopen(config->batch + 1, "rt");
+		if(!f)
+		{
+			ERROR("Unable to open input list %s", config->batch + 1);
+			ERROR("fopen: %s", strerror(errno));
+			return(-1);
+		}
+		
+		while(fgets(line, sizeof(line), f))
+		{
+			line[strcspn(line, "\r\n")] = '\0';
+			if(*line && fswc_batch_add(input, inputs, line)) break;
+		}
+		
+		fclose(f);
+	}
+	else if(!stat(config->batch, &st) && S_ISDIR(st.st_mode))
+	{
+		struct dirent *e;
+		char path[FILENAME_MAX];
+		DIR *d;
+		
+		/* Every file in a directory, in order. */
+		d = opendir(config->batch);
+		if(!d)
+		{
+			ERROR("Unable to open directory %s", config->batch);
+			ERROR("opendir: %s", strerror(errno));
+			return(-1);
+		}
+		
+		while((e = readdir(d)))
+		{
+			if(*e->d_name == '.') continue;
+			
+			snprintf(path, sizeof(path), "%s/%s", config->batch, e->d_name);
+			if(stat(path, &st) || !S_ISREG(st.st_mode)) continue;
+			
+			if(fswc_batch_add(input, inputs, path)) break;
+		}
+		
+		closedir(d);
+		
+		qsort(*input, *inputs, sizeof(char *), fswc_batch_cmp);
+	}
+	else
+	{
+		glob_t g;
+		size_t i;
+		
+		/* Otherwise a pattern to match. */
+		if(glob(config->batch, 0, NULL, &g))
+		{
+			ERROR("No files match %s", config->batch);
+			return(-1);
+		}
+		
+		for(i = 0; i < g.gl_pathc; i++)
+			if(fswc_batch_add(input, inputs, g.gl_pathv[i])) break;
+		
+		globfree(&g);
+	}
+	
+	return(0);
+}
+
+void *fswc_batch_worker(void *arg)
+{
+	fswebcam_worker_t *w = (fswebcam_worker_t *) arg;
+	fswebcam_config_t *config = w->config;
+	uint32_t i;
+	char *name, *ext;
+	
+	while(!received_sigterm)
+	{
+		/* Take the next input. */
+		pthread_mutex_lock(w->lock);
+		i = (*w->next)++;
+		pthread_mutex_unlock(w->lock);
+		
+		if(i >= w->inputs) break;
+		
+		/* %f is the file name without the path or extension. */
+		name = strrchr(w->input[i], '/');
+		name = strdup(name ? name + 1 : w->input[i]);
+		if(!name)
+		{
+			ERROR("Out of memory.");
+			break;
+		}
+		
+		ext = strrchr(name, '.');
+		if(ext && ext != name) *ext = '\0';
+		
+		config->batch_name = name;
+		
+		fswc_free_devices(config);
+		fswc_add_device(config, w->input[i]);
+		
+		if(fswc_grab(config))
+		{
+			pthread_mutex_lock(w->lock);
+			(*w->failed)++;
+			pthread_mutex_unlock(w->lock);
+		}
+		
+		config->batch_name = NULL;
+		free(name);
+	}
+	
+	return(NULL);
+}
+
+int fswc_batch(fswebcam_config_t *config, int argc, char *argv[])
+{
+	fswebcam_worker_t *worker;
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct timespec start, end;
+	char **input;
+	uint32_t i, inputs, next, failed, workers;
+	double seconds;
+	
+	if(fswc_batch_inputs(config, &input, &inputs)) return(-1);
+	
+	if(!inputs)
+	{
+		ERROR("No files to process.");
+		free(input);
+		return(-1);
+	}
+	
+	workers = config->workers;
+	if(!workers) workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers < 1) workers = 1;
+	if(workers > inputs) workers = inputs;
+	
+	HEAD("--- Processing %i files with %i threads...", inputs, workers);
+	
+	worker = calloc(workers, sizeof(fswebcam_worker_t));
+	if(!worker)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	next = failed = 0;
+	
+	/* Each worker has its own copy of the configuration,
+	 * as it is changed while the image is processed. */
+	for(i = 0; i < workers; i++)
+	{
+		worker[i].input  = input;
+		worker[i].inputs = inputs;
+		worker[i].next   = &next;
+		worker[i].failed = &failed;
+		worker[i].lock   = &lock;
+		
+		if(!i)
+		{
+			worker[i].config = config;
+			continue;
+		}
+		
+		worker[i].config = calloc(sizeof(fswebcam_config_t), 1);
+		if(!worker[i].config ||
+		   fswc_getopts(worker[i].config, argc, argv))
+		{
+			ERROR("Unable to set up batch thread %i.", i);
+			if(worker[i].config) fswc_free_config(worker[i].config);
+			free(worker[i].config);
+			worker[i].config = NULL;
+		}
+	}
+	
+	/* gd's font cache must be set up before the threads use it. */
+	gdFontCacheSetup();
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	for(i = 1; i < workers; i++)
+	{
+		if(!worker[i].config) continue;
+		
+		if(pthread_create(&worker[i].thread, NULL,
+		                  fswc_batch_worker, &worker[i]))
+		{
+			ERROR("Unable to start batch thread %i.", i);
+			fswc_free_config(worker[i].config);
+			free(worker[i].config);
+			worker[i].config = NULL;
+		}
+	}
+	
+	fswc_batch_worker(&worker[0]);
+	
+	for(i = 1; i < workers; i++)
+	{
+		if(!worker[i].config) continue;
+		
+		pthread_join(worker[i].thread, NULL);
+		fswc_free_config(worker[i].config);
+		free(worker[i].config);
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	seconds  = end.tv_sec - start.tv_sec;
+	seconds += (end.tv_nsec - start.tv_nsec) / 1e9;
+	
+	/* Files not reached if the batch was stopped early. */
+	if(next > inputs) next = inputs;
+	
+	MSG("Processed %i of %i files in %.2f seconds (%.2f per second).",
+	    next - failed, inputs, seconds,
+	    seconds > 0 ? (next - failed) / seconds : 0);
+	
+	if(failed) WARN("%i files failed.", failed);
+	
+	for(i = 0; i < inputs; i++) free(input[i]);
+	free(input);
+	free(worker);
+	
+	return(failed ? -1 : 0);
+}
+
 int main(int argc, char *argv[])
 {
 	fswebcam_config_t *config;
@@ -1658,6 +3596,9 @@ int main(int argc, char *argv[])
 	/* Set defaults and parse the command line. */
 	if(fswc_getopts(config, argc, argv)) return(-1);
 	
+	/* Measure the decoders instead of capturing, if requested. */
+	if(config->benchmark) return(fswc_benchmark_palettes(config));
+	
 	/* Open the log file if one was specified. */
 	if(config->logfile && fswc_openlog(config)) return(-1);
 	
@@ -1673,40 +3614,100 @@ int main(int argc, char *argv[])
 	/* Enable FontConfig support in GD */
 	if(!gdFTUseFontConfig(1)) DEBUG("gd has no fontconfig support");
 	
+	/* Process a batch of files instead of capturing, if requested. */
+	if(config->batch) r = fswc_batch(config, argc, argv);
+	
 	/* Capture the image(s). */
-	if(!config->loop) r = fswc_grab(config);
+	else if(!config->loop)
+	{
+		/* Without a loop the frame is from the next whole second,
+		 * unless a time was given. Wait until a second before it. */
+		if(!config->sync_time.tv_sec)
+		{
+			gettimeofday(&config->sync_target, NULL);
+			config->sync_target.tv_sec++;
+			config->sync_target.tv_usec = 0;
+		}
+		else
+		{
+			config->sync_target = config->sync_time;
+			
+			while(time(NULL) < config->sync_target.tv_sec - 1 &&
+			      !received_sigterm) usleep(250000);
+		}
+		
+		if(!received_sigterm) r = fswc_grab(config);
+	}
 	else
 	{
 		/* Loop mode ... keep capturing images until terminated. */
 		while(1 == 1)
 		{
 			time_t capturetime = time(NULL);
+			struct timeval tv;
 			char timestamp[32];
 			
 			/* Calculate when the next image is due. */
-			capturetime -= (capturetime % config->loop);
-			capturetime += config->loop + config->offset;
+			if(config->sync_time.tv_sec)
+			{
+				time_t d;
+				
+				/* Images are due every loop from the sync time. */
+				d  = capturetime - config->sync_time.tv_sec;
+				d %= (time_t) config->loop;
+				if(d < 0) d += config->loop;
+				
+				capturetime += config->loop - d;
+				
+				tv.tv_usec = config->sync_time.tv_usec;
+			}
+			else
+			{
+				capturetime -= (capturetime % config->loop);
+				capturetime += config->loop + config->offset;
+				
+				/* Correct the capturetime if the offset pushes
+				 * it to far into the future. */
+				if(capturetime - time(NULL) > config->loop)
+					capturetime -= config->loop;
+				
+				tv.tv_usec = 0;
+			}
 			
-			/* Correct the capturetime if the offset pushes
-			 * it to far into the future. */
-			if(capturetime - time(NULL) > config->loop)
-				capturetime -= config->loop;
+			tv.tv_sec = capturetime;
 			
 			fswc_strftime(timestamp, 32, "%Y-%m-%d %H:%M:%S (%Z)",
-			              capturetime, config->gmt);
+			              &tv, config);
 			
 			MSG(">>> Next image due: %s", timestamp);
 			
-			/* Wait until that time comes. */
-			while(time(NULL) < capturetime)
+			/* Wait until that time comes. When syncing, start
+			 * early so the frames around it can be compared. */
+			while(time(NULL) < capturetime - (config->sync ? 1 : 0))
 			{
 				usleep(250000);
 				if(received_sighup)
 				{
+					fswebcam_config_t *old = config;
+					
 					/* Reload configuration. */
 					MSG("Received HUP signal... reloading configuration.");
-					fswc_free_config(config);
-					fswc_getopts(config, argc, argv);
+					config = calloc(sizeof(fswebcam_config_t), 1);
+					if(!config)
+					{
+						ERROR("Out of memory.");
+						config = old;
+					}
+					else
+					{
+						fswc_getopts(config, argc, argv);
+						
+						/* Keep the source open if it's unchanged. */
+						fswc_reload_source(old, config);
+						
+						fswc_free_config(old);
+						free(old);
+					}
 					
 					/* Clear hup signal. */
 					received_sighup = 0;
@@ -1727,6 +3728,11 @@ int main(int argc, char *argv[])
 			
 			if(received_sigterm) break;
 			
+			/* Use the frame from when the image was due, or from
+			 * now if the capture was brought forward. */
+			if(received_sigusr1) gettimeofday(&config->sync_target, NULL);
+			else config->sync_target = tv;
+			
 			/* Clear usr1 signal. */
 			received_sigusr1 = 0;
 			
@@ -1738,6 +3744,10 @@ int main(int argc, char *argv[])
 		}
 	}
 	
+	/* Stop exporting and recording frames. */
+	dmabuf_close();
+	record_close();
+	
 	/* Close the log file. */
 	if(config->logfile) log_close();
 	
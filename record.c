@@ -0,0 +1,159 @@
+/* fswebcam - FireStorm.cx's webcam generator                 */
+/*============================================================*/
+/* Copyright (C)2005-2011 Philip Heron <phil@sanslogic.co.uk> */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "record.h"
+#include "log.h"
+
+static FILE *record_f = NULL;
+static char *record_path = NULL;
+
+/* Sources capturing in other threads share the one file. */
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void record_shutdown(void);
+
+static int record_create(char *path)
+{
+	record_header_t header;
+	
+	/* The file stays open for the life of the process, so
+	 * reopening the source doesn't start a new recording. */
+	if(record_f)
+	{
+		if(!strcmp(path, record_path)) return(0);
+		record_shutdown();
+	}
+	
+	record_f = fopen(path, "wb");
+	if(!record_f)
+	{
+		ERROR("Error creating recording: %s", path);
+		ERROR("fopen: %s", strerror(errno));
+		return(-1);
+	}
+	
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+	header.version     = RECORD_VERSION;
+	header.header_size = sizeof(record_frame_t);
+	
+	if(fwrite(&header, sizeof(header), 1, record_f) != 1)
+	{
+		ERROR("Error writing to %s", path);
+		fclose(record_f);
+		record_f = NULL;
+		return(-1);
+	}
+	
+	record_path = strdup(path);
+	
+	MSG("Recording frames to %s.", path);
+	
+	return(0);
+}
+
+static int record_write(src_t *src)
+{
+	record_frame_t frame;
+	size_t r;
+	int i;
+	
+	if(!record_f) return(0);
+	
+	memset(&frame, 0, sizeof(frame));
+	frame.sequence = src->sequence;
+	frame.palette  = src->palette;
+	frame.width    = src->width;
+	frame.height   = src->height;
+	frame.length   = src->length;
+	frame.planes   = src->planes;
+	frame.tv_sec   = src->timestamp.tv_sec;
+	frame.tv_usec  = src->timestamp.tv_usec;
+	frame.wc_sec   = src->wallclock.tv_sec;
+	frame.wc_usec  = src->wallclock.tv_usec;
+	
+	if(src->planes)
+	{
+		frame.length = 0;
+		for(i = 0; i < src->planes; i++)
+		{
+			frame.plane_length[i] = src->plane_length[i];
+			frame.plane_stride[i] = src->plane_stride[i];
+			frame.length += src->plane_length[i];
+		}
+	}
+	
+	r = fwrite(&frame, sizeof(frame), 1, record_f);
+	
+	if(r && !src->planes && src->length)
+		r = fwrite(src->img, src->length, 1, record_f);
+	
+	for(i = 0; r && i < src->planes; i++)
+		if(src->plane_length[i])
+			r = fwrite(src->plane[i], src->plane_length[i], 1, record_f);
+	
+	if(!r)
+	{
+		/* Give up rather than fail every capture. */
+		ERROR("Error writing to %s", record_path);
+		ERROR("fwrite: %s", strerror(errno));
+		record_shutdown();
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static void record_shutdown(void)
+{
+	if(record_f) fclose(record_f);
+	free(record_path);
+	
+	record_f = NULL;
+	record_path = NULL;
+}
+
+int record_open(char *path)
+{
+	int r;
+	
+	pthread_mutex_lock(&record_lock);
+	r = record_create(path);
+	pthread_mutex_unlock(&record_lock);
+	
+	return(r);
+}
+
+int record_frame(src_t *src)
+{
+	int r;
+	
+	pthread_mutex_lock(&record_lock);
+	r = record_write(src);
+	pthread_mutex_unlock(&record_lock);
+	
+	return(r);
+}
+
+void record_close(void)
+{
+	pthread_mutex_lock(&record_lock);
+	record_shutdown();
+	pthread_mutex_unlock(&record_lock);
+}
+
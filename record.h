@@ -0,0 +1,50 @@
+/* fswebcam - FireStorm.cx's webcam generator                 */
+/*============================================================*/
+/* Copyright (C)2005-2011 Philip Heron <phil@sanslogic.co.uk> */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#include <stdint.h>
+#include "src.h"
+
+#ifndef INC_RECORD_H
+#define INC_RECORD_H
+
+/* A recording starts with this header, followed by each frame as it
+ * came from the source: a record_frame_t and then the image data.
+ * Separate image planes are stored one after another. All values are
+ * in the byte order of the machine that made the recording. */
+
+#define RECORD_MAGIC   "fswc-rec"
+#define RECORD_VERSION (1)
+
+typedef struct {
+	char     magic[8];
+	uint32_t version;
+	uint32_t header_size; /* sizeof(record_frame_t) */
+} record_header_t;
+
+typedef struct {
+	uint32_t sequence;
+	uint32_t palette;
+	uint32_t width;
+	uint32_t height;
+	uint32_t length; /* Total of all planes */
+	uint32_t planes; /* 0 if the image is in one piece */
+	uint32_t plane_length[SRC_MAX_PLANES];
+	uint32_t plane_stride[SRC_MAX_PLANES];
+	int64_t  tv_sec;  /* Capture time, CLOCK_MONOTONIC */
+	int64_t  tv_usec;
+	int64_t  wc_sec;  /* Capture time, real time */
+	int64_t  wc_usec;
+} record_frame_t;
+
+extern int record_open(char *path);
+extern int record_frame(src_t *src);
+extern void record_close(void);
+
+#endif
+
@@ -0,0 +1,104 @@
+/* fswebcam - FireStorm.cx's webcam generator                 */
+/*============================================================*/
+/* Copyright (C)2005-2011 Philip Heron <phil@sanslogic.co.uk> */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "ring.h"
+#include "log.h"
+
+int ring_init(ring_t *ring, uint32_t size)
+{
+	memset(ring, 0, sizeof(ring_t));
+	
+	ring->slot = calloc(size, sizeof(void *));
+	if(!ring->slot)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	ring->size = size;
+	
+	sem_init(&ring->used, 0, 0);
+	sem_init(&ring->free, 0, size);
+	
+	return(0);
+}
+
+void ring_free(ring_t *ring)
+{
+	sem_destroy(&ring->used);
+	sem_destroy(&ring->free);
+	
+	free(ring->slot);
+	ring->slot = NULL;
+}
+
+int ring_push(ring_t *ring, void *item, int wait)
+{
+	uint32_t head;
+	
+	/* Wait for a free slot, or give up if the ring is full. */
+	if(wait)
+	{
+		while(sem_wait(&ring->free) == -1)
+			if(errno != EINTR) return(-1);
+	}
+	else if(sem_trywait(&ring->free) == -1) return(-1);
+	
+	head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	ring->slot[head % ring->size] = item;
+	
+	/* Publish the slot before waking the consumer. */
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	sem_post(&ring->used);
+	
+	return(0);
+}
+
+void *ring_pop(ring_t *ring, int wait)
+{
+	uint32_t tail;
+	void *item;
+	
+	/* Wait for an item, or give up if the ring is empty. */
+	if(wait)
+	{
+		while(sem_wait(&ring->used) == -1)
+			if(errno != EINTR) return(NULL);
+	}
+	else if(sem_trywait(&ring->used) == -1) return(NULL);
+	
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	
+	/* The producer has finished and the ring is empty. */
+	if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+		return(NULL);
+	
+	item = ring->slot[tail % ring->size];
+	
+	/* Hand the slot back to the producer. */
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	sem_post(&ring->free);
+	
+	return(item);
+}
+
+void ring_close(ring_t *ring)
+{
+	/* The extra post wakes the consumer once everything has
+	 * been read, and ring_pop() then returns NULL. */
+	sem_post(&ring->used);
+}
+
@@ -0,0 +1,40 @@
+/* fswebcam - FireStorm.cx's webcam generator                 */
+/*============================================================*/
+/* Copyright (C)2005-2011 Philip Heron <phil@sanslogic.co.uk> */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#include <stdint.h>
+#include <semaphore.h>
+
+#ifndef INC_RING_H
+#define INC_RING_H
+
+/* A ring of pointers passed from one producer thread to one consumer
+ * thread. The slots are handed over with atomic loads and stores, the
+ * semaphores are only used to sleep while the ring is empty or full. */
+
+typedef struct {
+	
+	uint32_t size;
+	void **slot;
+	
+	uint32_t head; /* Next slot to fill, written by the producer */
+	uint32_t tail; /* Next slot to empty, written by the consumer */
+	
+	sem_t used;
+	sem_t free;
+	
+} ring_t;
+
+extern int ring_init(ring_t *ring, uint32_t size);
+extern void ring_free(ring_t *ring);
+extern int ring_push(ring_t *ring, void *item, int wait);
+extern void *ring_pop(ring_t *ring, int wait);
+extern void ring_close(ring_t *ring);
+
+#endif
+
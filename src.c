@@ -11,13 +11,18 @@
 #include "config.h"
 #endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include "parse.h"
 #include "src.h"
+#include "dmabuf.h"
+#include "record.h"
 #include "log.h"
 
 #ifdef HAVE_V4L2
@@ -26,8 +31,10 @@ extern src_mod_t src_v4l2;
 #ifdef HAVE_V4L1
 extern src_mod_t src_v4l1;
 #endif
+extern src_mod_t src_replay;
 extern src_mod_t src_file;
 extern src_mod_t src_raw;
+extern src_mod_t src_pipe;
 extern src_mod_t src_test;
 
 /* Modules should be listed here in order of preference. */
@@ -38,46 +45,106 @@ src_mod_t* src_mod[] = {
 #ifdef HAVE_V4L1
 	&src_v4l1,
 #endif
+	&src_replay,
 	&src_file,
 	&src_raw,
+	&src_pipe,
 	&src_test,
 	0
 };
 
-/* Supported palette types. */
+/* Supported palette types. The decode times are replaced by
+ * those from a benchmark if a palette cost file is loaded. */
 src_palette_t src_palette[] = {
-	{ "PNG" },
-	{ "JPEG" },
-	{ "MJPEG" },
-	{ "S561" },
-	{ "RGB32" },
-	{ "BGR32" },
-	{ "ABGR32" },
-	{ "RGB24" },
-	{ "BGR24" },
-	{ "YUYV" },
-	{ "UYVY" },
-	{ "VYUY" },
-	{ "YUV420P" },
-	{ "NV12MB" },
-	{ "BAYER" },
-	{ "SBGGR8" },
-	{ "SRGGB8" },
-	{ "SGBRG8" },
-	{ "SGRBG8" },
-	{ "RGB565" },
-	{ "RGB555" },
-	{ "Y16" },
-	{ "GREY" },
+	{ "PNG",     40.0, 1.5,  8 },
+	{ "JPEG",    25.0, 0.3,  3 },
+	{ "MJPEG",   27.0, 0.3,  3 },
+	{ "S561",    12.0, 0.6,  2 },
+	{ "RGB32",    3.0, 4.0,  8 },
+	{ "BGR32",    3.0, 4.0,  8 },
+	{ "ABGR32",   3.0, 4.0,  8 },
+	{ "RGB24",    3.0, 3.0,  8 },
+	{ "BGR24",    3.0, 3.0,  8 },
+	{ "YUYV",     5.0, 2.0,  6 },
+	{ "UYVY",     5.0, 2.0,  6 },
+	{ "VYUY",     5.0, 2.0,  6 },
+	{ "YUV420P",  5.0, 1.5,  5 },
+	{ "NV12MB",   8.0, 1.5,  5 },
+	{ "BAYER",    8.0, 1.0,  4 },
+	{ "SBGGR8",   8.0, 1.0,  4 },
+	{ "SRGGB8",   8.0, 1.0,  4 },
+	{ "SGBRG8",   8.0, 1.0,  4 },
+	{ "SGRBG8",   8.0, 1.0,  4 },
+	{ "RGB565",   4.0, 2.0,  4 },
+	{ "RGB555",   4.0, 2.0,  3 },
+	{ "Y16",      3.0, 2.0,  2 },
+	{ "GREY",     2.0, 1.0,  1 },
+	{ "NV12",     5.0, 1.5,  5 },
+	{ "NV16",     5.0, 2.0,  6 },
 	{ NULL }
 };
 
+/* Free page aligned buffers, kept for reuse. */
+#define SRC_POOL_SIZE (32)
+
+typedef struct {
+	void *start;
+	size_t length;
+} src_pool_t;
+
+static src_pool_t src_pool[SRC_POOL_SIZE];
+static pthread_mutex_t src_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int src_probe(src_t *src, char *s)
+{
+	int i;
+	struct stat st;
+	
+	/* No source type was specified. If the name is that of a file or
+	 * device we can check each source until we find one that works. */
+	if(stat(s, &st))
+	{
+		ERROR("stat: %s", strerror(errno));
+		free(s);
+		return(-1);
+	}
+	
+	i = 0;
+	src->source = s;
+	
+	while(src_mod[i])
+	{
+		int r = src_mod[i]->flags;
+		
+		if(S_ISCHR(st.st_mode) && r & SRC_TYPE_DEVICE) r = -1;
+		else if(!S_ISCHR(st.st_mode) && r & SRC_TYPE_FILE) r = -1;
+		else r = 0;
+		
+		if(r)
+		{
+			MSG("Trying source module %s...", src_mod[i]->name);
+			
+			src->type = i;
+			r = src_mod[src->type]->open(src);
+			
+			if(r != -2) return(r);
+		}
+		
+		i++;
+	}
+	
+	ERROR("Unable to find a source module that can read %s.", s);
+	
+	free(s);
+	
+	return(-1);
+}
+
 int src_open(src_t *src, char *source)
 {
 	int i;
 	size_t sl;
 	char *s;
-	struct stat st;
 	
 	if(!source)
 	{
@@ -85,6 +152,12 @@ int src_open(src_t *src, char *source)
 		return(-1);
 	}
 	
+	/* Start listening for clients if frames are to be exported. */
+	if(src->dmabuf && dmabuf_open(src->dmabuf)) return(-1);
+	
+	/* Start the recording, if there is to be one. */
+	if(src->record && record_open(src->record)) return(-1);
+	
 	sl = strlen(source) + 1;
 	s = malloc(sl);
 	if(!s)
@@ -128,50 +201,38 @@ int src_open(src_t *src, char *source)
 		i++;
 	}
 	
-	/* No source type was specified. If the name is that of a file or
-	 * device we can check each source until we find one that works. */
-	if(stat(s, &st))
+	return(src_probe(src, s));
+}
+
+int src_open_path(src_t *src, char *path)
+{
+	char *s;
+	
+	if(!path)
 	{
-		ERROR("stat: %s", strerror(errno));
-		free(s);
+		ERROR("No source was specified.");
 		return(-1);
 	}
 	
-	i = 0;
-	src->source = s;
+	/* Start listening for clients if frames are to be exported. */
+	if(src->dmabuf && dmabuf_open(src->dmabuf)) return(-1);
 	
-	while(src_mod[i])
+	/* Start the recording, if there is to be one. */
+	if(src->record && record_open(src->record)) return(-1);
+	
+	/* The path is used whole, even if it contains a ':'. */
+	s = strdup(path);
+	if(!s)
 	{
-		int r = src_mod[i]->flags;
-		
-		if(S_ISCHR(st.st_mode) && r & SRC_TYPE_DEVICE) r = -1;
-		else if(!S_ISCHR(st.st_mode) && r & SRC_TYPE_FILE) r = -1;
-		else r = 0;
-		
-		if(r)
-		{
-			MSG("Trying source module %s...", src_mod[i]->name);
-			
-			src->type = i;
-			r = src_mod[src->type]->open(src);
-			
-			if(r != -2) return(r);
-		}
-		
-		i++;
+		ERROR("Out of memory.");
+		return(-1);
 	}
 	
-	ERROR("Unable to find a source module that can read %s.", source);
-	
-	free(s);
-	
-	return(-1);
+	return(src_probe(src, s));
 }
 
-int src_close(src_t *src)
+int src_show_stats(src_t *src)
 {
-	int r;
-	
 	if(src->captured_frames)
 	{
 		double seconds =
@@ -194,8 +255,36 @@ int src_close(src_t *src)
 			    src->captured_frames, seconds,
 			    (int) (src->captured_frames / seconds));
 		}
+		
+		if(src->dropped_frames || src->error_frames)
+		{
+			WARN("Dropped %i frames, %i frames with errors.",
+			     src->dropped_frames, src->error_frames);
+		}
 	}
 	
+	if(src->outages)
+	{
+		WARN("Lost the device %i times, for %0.2f seconds.",
+		     src->outages, src->outage_time);
+	}
+	
+	/* Start counting again from the next frame. */
+	src->captured_frames = 0;
+	src->dropped_frames  = 0;
+	src->error_frames    = 0;
+	src->outages         = 0;
+	src->outage_time     = 0;
+	
+	return(0);
+}
+
+int src_close(src_t *src)
+{
+	int r;
+	
+	src_show_stats(src);
+	
 	r = src_mod[src->type]->close(src);
 	
 	if(src->source) free(src->source);
@@ -203,21 +292,281 @@ int src_close(src_t *src)
 	return(r);
 }
 
+static int src_gettime(clockid_t clock, struct timeval *tv)
+{
+	struct timespec ts;
+	
+	if(clock_gettime(clock, &ts) == -1)
+	{
+		ERROR("clock_gettime: %s", strerror(errno));
+		timerclear(tv);
+		return(-1);
+	}
+	
+	tv->tv_sec  = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+	
+	return(0);
+}
+
+static void src_set_wallclock(src_t *src)
+{
+	struct timeval now, age;
+	
+	/* Work out how long ago the frame was captured, and take
+	 * that away from the current real time. */
+	src_gettime(CLOCK_MONOTONIC, &now);
+	gettimeofday(&src->wallclock, NULL);
+	
+	if(!timercmp(&src->timestamp, &now, <)) return;
+	
+	timersub(&now, &src->timestamp, &age);
+	timersub(&src->wallclock, &age, &src->wallclock);
+}
+
 int src_grab(src_t *src)
 {
-	int r = src_mod[src->type]->grab(src);
+	uint32_t sequence = src->sequence;
+	int r;
+	
+	src->dmabuf_fd = -1;
+	timerclear(&src->timestamp);
+	
+	r = src_mod[src->type]->grab(src);
 	
 	if(!r)
 	{
-		if(!src->captured_frames) gettimeofday(&src->tv_first, NULL);
-		gettimeofday(&src->tv_last, NULL);
+		/* Count any frames missed since the previous one. */
+		if(src->captured_frames && src->sequence > sequence + 1)
+			src->dropped_frames += src->sequence - sequence - 1;
+		
+		/* Use the time now if the source didn't provide one. */
+		if(!timerisset(&src->timestamp))
+			src_gettime(CLOCK_MONOTONIC, &src->timestamp);
+		
+		src_set_wallclock(src);
+		
+		if(!src->captured_frames) src->tv_first = src->timestamp;
+		src->tv_last = src->timestamp;
 		
 		src->captured_frames++;
+		
+		/* Pass the frame on to any other processes. */
+		if(src->dmabuf) dmabuf_send(src);
+		if(src->record) record_frame(src);
 	}
 	
 	return(r);
 }
 
+int src_set_controls(src_t *src)
+{
+	/* Not every source can change controls while open. */
+	if(!src_mod[src->type]->set_controls) return(-1);
+	
+	return(src_mod[src->type]->set_controls(src));
+}
+
+int src_standby(src_t *src, char on)
+{
+	/* Sources that can't slow down just carry on. */
+	if(!src_mod[src->type]->set_standby) return(-1);
+	
+	return(src_mod[src->type]->set_standby(src, on));
+}
+
+int src_set_input(src_t *src, char *input, uint32_t frequency)
+{
+	/* Nothing to do if the input is already selected. */
+	if(src->frequency == frequency && (src->input == input ||
+	   (src->input && input && !strcmp(src->input, input)))) return(0);
+	
+	/* Other sources have to be reopened. */
+	if(!src_mod[src->type]->set_input) return(-1);
+	
+	src->input     = input;
+	src->frequency = frequency;
+	
+	return(src_mod[src->type]->set_input(src));
+}
+
+int src_trigger(src_t *src)
+{
+	/* Record the time the capture was requested. */
+	return(src_gettime(CLOCK_MONOTONIC, &src->trigger));
+}
+
+void *src_detach(src_t *src)
+{
+	void *img;
+	
+	if(!src->img) return(NULL);
+	
+	/* Take the buffer if the source allows it. */
+	if(src->pooled)
+	{
+		src->detached = -1;
+		return(src->img);
+	}
+	
+	/* Otherwise make a copy. */
+	img = src_pool_alloc(src->length);
+	if(!img)
+	{
+		ERROR("Out of memory.");
+		return(NULL);
+	}
+	
+	memcpy(img, src->img, src->length);
+	
+	return(img);
+}
+
+void *src_pool_alloc(size_t length)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	int i, best = -1;
+	void *start;
+	
+	/* The pool is shared by sources in other threads. */
+	pthread_mutex_lock(&src_pool_lock);
+	
+	/* Look for the smallest free buffer that will fit. */
+	for(i = 0; i < SRC_POOL_SIZE; i++)
+	{
+		if(!src_pool[i].start || src_pool[i].length < length) continue;
+		if(best == -1 || src_pool[i].length < src_pool[best].length)
+			best = i;
+	}
+	
+	if(best != -1)
+	{
+		start = src_pool[best].start;
+		src_pool[best].start = NULL;
+		pthread_mutex_unlock(&src_pool_lock);
+		return(start);
+	}
+	
+	pthread_mutex_unlock(&src_pool_lock);
+	
+	/* Nothing suitable, allocate a new one. */
+	length = (length + page - 1) / page * page;
+	if(posix_memalign(&start, page, length)) return(NULL);
+	
+	return(start);
+}
+
+void src_pool_free(void *start, size_t length)
+{
+	int i, smallest = -1;
+	
+	if(!start) return;
+	
+	pthread_mutex_lock(&src_pool_lock);
+	
+	for(i = 0; i < SRC_POOL_SIZE; i++)
+	{
+		if(!src_pool[i].start) break;
+		if(smallest == -1 || src_pool[i].length < src_pool[smallest].length)
+			smallest = i;
+	}
+	
+	/* If the pool is full, replace the smallest buffer. */
+	if(i == SRC_POOL_SIZE)
+	{
+		if(src_pool[smallest].length > length)
+		{
+			pthread_mutex_unlock(&src_pool_lock);
+			free(start);
+			return;
+		}
+		
+		free(src_pool[smallest].start);
+		i = smallest;
+	}
+	
+	src_pool[i].start  = start;
+	src_pool[i].length = length;
+	
+	pthread_mutex_unlock(&src_pool_lock);
+}
+
+int src_load_palette_costs(char *filename)
+{
+	char line[128], name[32];
+	float decode;
+	FILE *f;
+	int i;
+	
+	f = fopen(filename, "rt");
+	if(!f)
+	{
+		ERROR("Unable to read palette costs from %s", filename);
+		ERROR("fopen: %s", strerror(errno));
+		return(-1);
+	}
+	
+	/* Each line holds a palette name and its decode time. */
+	while(fgets(line, sizeof(line), f))
+	{
+		if(*line == '#') continue;
+		if(sscanf(line, "%31s %f", name, &decode) != 2) continue;
+		
+		for(i = 0; src_palette[i].name; i++)
+			if(!strcasecmp(src_palette[i].name, name)) break;
+		
+		if(!src_palette[i].name || decode <= 0)
+		{
+			WARN("Ignoring palette cost: %s %f", name, decode);
+			continue;
+		}
+		
+		src_palette[i].decode = decode;
+	}
+	
+	fclose(f);
+	
+	return(0);
+}
+
+size_t src_frame_size(int palette, uint32_t width, uint32_t height)
+{
+	size_t pixels = (size_t) width * height;
+	
+	/* Returns 0 for palettes without a fixed frame size. */
+	switch(palette)
+	{
+	case SRC_PAL_RGB32:
+	case SRC_PAL_BGR32:
+	case SRC_PAL_ABGR32:
+		return(pixels * 4);
+	case SRC_PAL_RGB24:
+	case SRC_PAL_BGR24:
+		return(pixels * 3);
+	case SRC_PAL_RGB565:
+	case SRC_PAL_RGB555:
+	case SRC_PAL_YUYV:
+	case SRC_PAL_UYVY:
+	case SRC_PAL_VYUY:
+	case SRC_PAL_Y16:
+	case SRC_PAL_NV16:
+		return(pixels * 2);
+	case SRC_PAL_YUV420P:
+	case SRC_PAL_NV12MB:
+	case SRC_PAL_NV12:
+		return(pixels * 3 / 2);
+	case SRC_PAL_BAYER:
+	case SRC_PAL_SBGGR8:
+	case SRC_PAL_SRGGB8:
+	case SRC_PAL_SGBRG8:
+	case SRC_PAL_SGRBG8:
+	case SRC_PAL_GREY:
+		return(pixels);
+	}
+	
+	return(0);
+}
+
 /* Pointers are great things. Terrible things yes, but great. */
 /* These work but are very ugly and will be re-written soon. */
 
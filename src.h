@@ -8,6 +8,7 @@
 /* copy should be included with this source.                  */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/time.h>
 
 #ifndef INC_SRC_H
@@ -43,6 +44,14 @@
 #define SRC_PAL_RGB555  (20)
 #define SRC_PAL_Y16     (21)
 #define SRC_PAL_GREY    (22)
+#define SRC_PAL_NV12    (23)
+#define SRC_PAL_NV16    (24)
+
+/* A frame_last that reads to the end of the file */
+#define SRC_FRAME_END (UINT32_MAX)
+
+/* The maximum number of separate image planes */
+#define SRC_MAX_PLANES (3)
 
 #define SRC_LIST_INPUTS     (1 << 1)
 #define SRC_LIST_TUNERS     (1 << 2)
@@ -51,12 +60,25 @@
 #define SRC_LIST_FRAMESIZES (1 << 5)
 #define SRC_LIST_FRAMERATES (1 << 6)
 
+/* How to choose a palette when none is requested. */
+#define SRC_POLICY_NONE     (0) /* The order the source prefers */
+#define SRC_POLICY_FASTEST  (1) /* The most frames per second */
+#define SRC_POLICY_SMALLEST (2) /* The least data from the device */
+#define SRC_POLICY_QUALITY  (3) /* The best image */
+
 /* The SCALE macro converts a value (sv) from one range (sf -> sr)
    to another (df -> dr). */
 #define SCALE(df, dr, sf, sr, sv) (((sv - sf) * (dr - df) / (sr - sf)) + df)
 
 typedef struct {
         char    *name;
+        
+        /* The time taken to decode a pixel (ns), the average bytes
+         * per pixel from the device and the image quality (higher
+         * is better). */
+        float   decode;
+        float   bytes;
+        uint8_t quality;
 } src_palette_t;
 
 extern src_palette_t src_palette[];
@@ -78,30 +100,96 @@ typedef struct {
 	uint32_t length;
 	void *img;
 	
+	/* Set by the source if the image planes are stored separately.
+	 * img and length then describe the first plane. */
+	uint8_t  planes;
+	void    *plane[SRC_MAX_PLANES];
+	uint32_t plane_length[SRC_MAX_PLANES];
+	uint32_t plane_stride[SRC_MAX_PLANES];
+	
+	/* Set by the source if img comes from the buffer pool. The
+	 * source replaces the buffer if it has been detached. img_size
+	 * is the size of the buffer, which may be more than length. */
+	char pooled;
+	char detached;
+	size_t img_size;
+	
+	/* The dmabuf for the last image, or -1 if it has none. */
+	int dmabuf_fd;
+	
 	/* Input Options */
 	char    *input;
 	uint8_t  tuner;
 	uint32_t frequency;
 	uint32_t delay;
-	uint32_t timeout;
+	uint32_t timeout; /* Milliseconds, 0 to wait forever */
 	char     use_read;
+	char     use_userptr;
+	uint32_t buffers;
+	char     fresh;
+	char    *dmabuf;
+	char    *record;
+	char    *cache;
+	char     realtime; /* Replay recordings at the speed captured */
+	
+	/* Frames to read from a file source: the first, the last
+	 * (SRC_FRAME_END for all) and the number to step by. */
+	uint32_t frame_first;
+	uint32_t frame_last;
+	uint32_t frame_step;
 	
 	/* List Options */
 	uint8_t list;
 	
 	/* Image Options */
 	int palette;
+	uint8_t palette_policy;
 	uint32_t width;
 	uint32_t height;
 	uint32_t fps;
 	
+	/* Set to pick the frame size and rate from those the source
+	 * offers. width and height are then the smallest size wanted. */
+	char auto_mode;
+	
+	/* Area of the image to capture, if the source can crop it.
+	 * A width of 0 captures the whole image, and an offset of -1
+	 * the center. The source sets cropped if it was able to. */
+	uint32_t crop_width;
+	uint32_t crop_height;
+	int32_t  crop_x;
+	int32_t  crop_y;
+	char     cropped;
+	
 	src_option_t **option;
 	
+	/* When fresh is set, frames captured before this time are
+	 * discarded. Uses CLOCK_MONOTONIC, cleared by the source. */
+	struct timeval trigger;
+	
 	/* For calculating capture FPS */
 	uint32_t captured_frames;
 	struct timeval tv_first;
 	struct timeval tv_last;
 	
+	/* For counting dropped and damaged frames. The source sets the
+	 * sequence number of each frame, if it has one. */
+	uint32_t sequence;
+	uint32_t dropped_frames;
+	uint32_t error_frames;
+	
+	/* The number of times the device was lost and reopened,
+	 * and the total time in seconds spent without it. */
+	uint32_t outages;
+	double   outage_time;
+	
+	/* The time the last frame was captured. The source sets the
+	 * timestamp from CLOCK_MONOTONIC if the device provides one,
+	 * otherwise the time the frame was grabbed is used. wallclock
+	 * holds the same moment in real time. */
+	struct timeval timestamp;
+	struct timeval wallclock;
+	
 } src_t;
 
 typedef struct {
@@ -114,11 +202,35 @@ typedef struct {
 	int (*close)(src_t *);
 	int (*grab)(src_t *);
 	
+	/* Optional. Applies src->option to an open source. */
+	int (*set_controls)(src_t *);
+	
+	/* Optional. Slows an open source down between captures
+	 * when on is set, or returns it to full speed. */
+	int (*set_standby)(src_t *, char on);
+	
+	/* Optional. Changes an open source to src->input,
+	 * tuned to src->frequency if it has a tuner. */
+	int (*set_input)(src_t *);
+	
 } src_mod_t;
 
 extern int src_open(src_t *src, char *source);
+extern int src_open_path(src_t *src, char *path);
 extern int src_close(src_t *src);
 extern int src_grab(src_t *src);
+extern int src_show_stats(src_t *src);
+extern int src_trigger(src_t *src);
+extern int src_set_controls(src_t *src);
+extern int src_standby(src_t *src, char on);
+extern int src_set_input(src_t *src, char *input, uint32_t frequency);
+extern void *src_detach(src_t *src);
+
+extern void *src_pool_alloc(size_t length);
+extern void src_pool_free(void *start, size_t length);
+
+extern int src_load_palette_costs(char *filename);
+extern size_t src_frame_size(int palette, uint32_t width, uint32_t height);
 
 extern int src_set_option(src_option_t ***options, char *name, char *value);
 extern int src_get_option_by_number(src_option_t **opt, int number, char **name, char **value);
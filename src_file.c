@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include "src.h"
 #include "log.h"
@@ -26,6 +27,9 @@ typedef struct {
 	uint8_t *start;
 	size_t length;
 	
+	/* Set if the file is mapped rather than read into memory. */
+	char map;
+	
 } src_file_t;
 
 int src_file_open_jpeg(src_t *src)
@@ -166,34 +170,53 @@ int src_file_open(src_t *src)
 		return(-2);
 	}
 	
-	/* Allocate memory for the file. */
 	s->length = st.st_size;
-	s->start = (uint8_t *) malloc(s->length);
-	if(!s->start)
+	
+	if(s->length < 4)
 	{
-		ERROR("Out of memory.");
+		ERROR("%s: Unexpected end of file.", src->source);
 		fclose(s->f);
 		free(s);
-		return(-1);
+		return(-2);
 	}
 	
-	/* Read the entire file into memory. */
-	size = 0;
-	while(!feof(s->f) && size < s->length)
-		size += fread(s->start, 1, s->length, s->f);
+	/* Map the file if possible, it's then read as it's decoded. */
+	s->start = mmap(NULL, s->length, PROT_READ, MAP_PRIVATE,
+	                fileno(s->f), 0);
+	if(s->start != MAP_FAILED) s->map = -1;
+	else
+	{
+		DEBUG("mmap: %s", strerror(errno));
+		
+		/* Allocate memory for the file. */
+		s->start = (uint8_t *) malloc(s->length);
+		if(!s->start)
+		{
+			ERROR("Out of memory.");
+			fclose(s->f);
+			free(s);
+			return(-1);
+		}
+		
+		/* Read the entire file into memory. */
+		size = 0;
+		while(!feof(s->f) && size < s->length)
+			size += fread(s->start + size, 1, s->length - size, s->f);
+		
+		if(size != s->length)
+		{
+			ERROR("Error reading file. Read %i bytes of %i byte file.",
+			      size, s->length);
+			fclose(s->f);
+			free(s->start);
+			free(s);
+			return(-1);
+		}
+	}
 	
 	fclose(s->f);
 	s->f = NULL;
 	
-	if(size != s->length)
-	{
-		ERROR("Error reading file. Read %i bytes of %i byte file.",
-		      size, s->length);
-		free(s->start);
-		free(s);
-		return(-1);
-	}
-	
 	src->length = s->length;
 	src->img    = s->start;
 	
@@ -237,7 +260,8 @@ int src_file_close(src_t *src)
 	src_file_t *s = (src_file_t *) src->state;
 	
 	if(s->f) fclose(s->f);
-	free(s->start);
+	if(s->map) munmap(s->start, s->length);
+	else free(s->start);
 	free(s);
 	
 	return(0);
@@ -0,0 +1,280 @@
+/* fswebcam - FireStorm.cx's webcam generator                 */
+/*============================================================*/
+/* Copyright (C)2005-2011 Philip Heron <phil@sanslogic.co.uk> */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+/* For F_SETPIPE_SZ */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include "src.h"
+#include "log.h"
+
+/* The buffer holds at least this many frames, so each read()
+ * can take in everything the writer has sent so far. */
+#define PIPE_FRAMES (4)
+#define PIPE_MIN_BUFFER (1 << 20)
+
+/* The largest length prefixed frame that will be accepted. */
+#define PIPE_MAX_FRAME (64 << 20)
+
+typedef struct {
+	
+	int fd;
+	
+	/* Data read but not yet used is held in buffer[start - end]. */
+	uint8_t *buffer;
+	size_t size;
+	size_t start;
+	size_t end;
+	
+	/* The size of each frame, or 0 if each is preceded
+	 * by its length. */
+	size_t frame;
+	
+	uint32_t count;
+	
+} src_pipe_t;
+
+int src_pipe_close(src_t *src);
+
+static int src_pipe_read(src_t *src, int timeout)
+{
+	src_pipe_t *s = (src_pipe_t *) src->state;
+	struct pollfd pfd;
+	ssize_t r;
+	
+	/* Make room at the end of the buffer. */
+	if(s->start && s->end == s->size)
+	{
+		memmove(s->buffer, s->buffer + s->start, s->end - s->start);
+		s->end  -= s->start;
+		s->start = 0;
+	}
+	
+	if(s->end == s->size) return(0);
+	
+	pfd.fd     = s->fd;
+	pfd.events = POLLIN;
+	
+	do r = poll(&pfd, 1, timeout);
+	while(r == -1 && errno == EINTR);
+	
+	if(r == -1)
+	{
+		ERROR("poll: %s", strerror(errno));
+		return(-1);
+	}
+	
+	if(!r)
+	{
+		if(timeout) ERROR("Timed out waiting for frame!");
+		return(timeout ? -1 : 0);
+	}
+	
+	do r = read(s->fd, s->buffer + s->end, s->size - s->end);
+	while(r == -1 && errno == EINTR);
+	
+	if(!r)
+	{
+		MSG("End of stream reached.");
+		return(-1);
+	}
+	
+	if(r < 0)
+	{
+		ERROR("Error reading from source");
+		ERROR("read: %s", strerror(errno));
+		return(-1);
+	}
+	
+	s->end += r;
+	
+	return(r);
+}
+
+/* Returns the length of the next frame including its prefix,
+ * or 0 if the length hasn't been read yet. */
+static size_t src_pipe_next(src_pipe_t *s, size_t offset)
+{
+	uint8_t *p = s->buffer + offset;
+	
+	if(s->frame) return(s->frame);
+	if(s->end - offset < 4) return(0);
+	
+	return(4 + (p[0] | (p[1] << 8) | (p[2] << 16) | ((size_t) p[3] << 24)));
+}
+
+static int src_pipe_fit(src_pipe_t *s, size_t length)
+{
+	uint8_t *buffer;
+	
+	if(length <= s->size) return(0);
+	
+	if(length > PIPE_MAX_FRAME)
+	{
+		ERROR("Frame of %lu bytes is too large.", (unsigned long) length);
+		return(-1);
+	}
+	
+	buffer = realloc(s->buffer, length * PIPE_FRAMES);
+	if(!buffer)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	s->buffer = buffer;
+	s->size   = length * PIPE_FRAMES;
+	
+	return(0);
+}
+
+int src_pipe_open(src_t *src)
+{
+	src_pipe_t *s;
+	struct stat st;
+	size_t size;
+	
+	s = calloc(sizeof(src_pipe_t), 1);
+	if(!s)
+	{
+		ERROR("Out of memory.");
+		return(-2);
+	}
+	
+	src->state = (void *) s;
+	
+	if(src->palette == SRC_PAL_ANY)
+	{
+		ERROR("No palette format specified.");
+		free(s);
+		return(-1);
+	}
+	
+	/* Image files vary in size, and are sent with their length. */
+	s->frame = src_frame_size(src->palette, src->width, src->height);
+	if(!s->frame && src->palette != SRC_PAL_JPEG &&
+	   src->palette != SRC_PAL_MJPEG && src->palette != SRC_PAL_PNG)
+	{
+		ERROR("Palette format not supported by pipe source.");
+		free(s);
+		return(-1);
+	}
+	
+	/* With no name given frames are read from stdin. */
+	if(!src->source || !strcmp(src->source, "-")) s->fd = STDIN_FILENO;
+	else s->fd = open(src->source, O_RDONLY);
+	
+	if(s->fd < 0)
+	{
+		ERROR("Error opening source: %s", src->source);
+		ERROR("open: %s", strerror(errno));
+		free(s);
+		return(-2);
+	}
+	
+	size = s->frame * PIPE_FRAMES;
+	if(size < PIPE_MIN_BUFFER) size = PIPE_MIN_BUFFER;
+	
+	s->buffer = malloc(size);
+	if(!s->buffer)
+	{
+		ERROR("Out of memory.");
+		src_pipe_close(src);
+		return(-1);
+	}
+	
+	s->size = size;
+	
+	/* A larger pipe lets the writer send a whole frame at once. */
+	if(!fstat(s->fd, &st) && S_ISFIFO(st.st_mode))
+	{
+		size = s->frame ? s->frame : PIPE_MIN_BUFFER;
+		if(size > PIPE_MIN_BUFFER) size = PIPE_MIN_BUFFER;
+		
+#ifdef F_SETPIPE_SZ
+		if(fcntl(s->fd, F_SETPIPE_SZ, size) == -1)
+			DEBUG("F_SETPIPE_SZ: %s", strerror(errno));
+#endif
+	}
+	
+	MSG("%s opened.", s->fd == STDIN_FILENO ? "stdin" : src->source);
+	
+	return(0);
+}
+
+int src_pipe_close(src_t *src)
+{
+	src_pipe_t *s = (src_pipe_t *) src->state;
+	
+	if(s->fd > STDIN_FILENO) close(s->fd);
+	free(s->buffer);
+	free(s);
+	
+	return(0);
+}
+
+int src_pipe_grab(src_t *src)
+{
+	src_pipe_t *s = (src_pipe_t *) src->state;
+	int timeout = src->timeout ? (int) src->timeout : -1;
+	size_t length;
+	
+	/* Read until a whole frame is in the buffer. */
+	while(!(length = src_pipe_next(s, s->start)) ||
+	      s->end - s->start < length)
+	{
+		if(length && src_pipe_fit(s, length)) return(-1);
+		if(src_pipe_read(src, timeout) < 0) return(-1);
+	}
+	
+	/* Skip to the newest frame the writer has sent. */
+	while(src->fresh)
+	{
+		size_t next = src_pipe_next(s, s->start + length);
+		
+		if(next && s->end - s->start - length >= next)
+		{
+			s->start += length;
+			length = next;
+			s->count++;
+			continue;
+		}
+		
+		/* Only read more if it fits behind this frame. */
+		if(s->end == s->size) break;
+		if(src_pipe_read(src, 0) <= 0) break;
+	}
+	
+	src->img    = s->buffer + s->start + (s->frame ? 0 : 4);
+	src->length = length - (s->frame ? 0 : 4);
+	src->sequence = ++s->count;
+	
+	s->start += length;
+	
+	return(0);
+}
+
+src_mod_t src_pipe = {
+	"pipe", SRC_TYPE_NONE,
+	src_pipe_open,
+	src_pipe_close,
+	src_pipe_grab
+};
+
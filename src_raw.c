@@ -17,6 +17,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "src.h"
 #include "log.h"
 
@@ -26,8 +28,44 @@ typedef struct {
 	char *img;
 	size_t size;
 	
+	/* The file if it could be mapped. */
+	char *map;
+	size_t map_length;
+	
+	/* The number of the next frame to grab,
+	 * and of frames read from a stream. */
+	uint32_t frame;
+	uint32_t read;
+	
 } src_raw_t;
 
+int src_raw_map(src_t *src)
+{
+	src_raw_t *s = (src_raw_t *) src->state;
+	struct stat st;
+	
+	if(fstat(s->fd, &st) == -1 || !S_ISREG(st.st_mode)) return(-1);
+	if(st.st_size < (off_t) s->size) return(-1);
+	
+	s->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, s->fd, 0);
+	if(s->map == MAP_FAILED)
+	{
+		DEBUG("mmap: %s", strerror(errno));
+		s->map = NULL;
+		return(-1);
+	}
+	
+	s->map_length = st.st_size;
+	
+	/* Frames are usually read in order. */
+	if(src->frame_step <= 1)
+		madvise(s->map, s->map_length, MADV_SEQUENTIAL);
+	
+	DEBUG("Mapped %lu frames.", (unsigned long) (s->map_length / s->size));
+	
+	return(0);
+}
+
 int src_raw_open(src_t *src)
 {
 	src_raw_t *s;
@@ -48,50 +86,17 @@ int src_raw_open(src_t *src)
 	src->state = (void *) s;
 	
 	/* Calculate size of the frame. */
-	switch(src->palette)
+	if(src->palette == SRC_PAL_ANY)
 	{
-	case SRC_PAL_ANY:
 		ERROR("No palette format specified.");
 		free(s);
 		return(-1);
-	case SRC_PAL_RGB32:
-	case SRC_PAL_BGR32:
-	case SRC_PAL_ABGR32:
-		s->size = src->width * src->height * 4;
-		break;
-	case SRC_PAL_RGB24:
-		s->size = src->width * src->height * 3;
-		break;
-	case SRC_PAL_RGB565:
-	case SRC_PAL_RGB555:
-	case SRC_PAL_YUYV:
-	case SRC_PAL_UYVY:
-	case SRC_PAL_VYUY:
-	case SRC_PAL_Y16:
-		s->size = src->width * src->height * 2;
-		break;
-	case SRC_PAL_YUV420P:
-	case SRC_PAL_NV12MB:
-		s->size = (src->width * src->height * 3) / 2;
-		break;
-	case SRC_PAL_BAYER:
-	case SRC_PAL_SBGGR8:
-	case SRC_PAL_SRGGB8:
-	case SRC_PAL_SGBRG8:
-	case SRC_PAL_SGRBG8:
-	case SRC_PAL_GREY:
-		s->size = src->width * src->height;
-		break;
-	default:
-		ERROR("Palette format not supported by raw source.");
-		free(s);
-		return(-1);
 	}
 	
-	s->img  = malloc(s->size);
-	if(!s->img)
+	s->size = src_frame_size(src->palette, src->width, src->height);
+	if(!s->size)
 	{
-		ERROR("Out of memory.");
+		ERROR("Palette format not supported by raw source.");
 		free(s);
 		return(-1);
 	}
@@ -102,13 +107,29 @@ int src_raw_open(src_t *src)
 	{
 		ERROR("Error opening source: %s", src->source);
 		ERROR("open: %s", strerror(errno));
-		free(s->img);
 		free(s);
 		return(-2);
 	}
 	
-	src->img = s->img;
+	/* Regular files are mapped, and frames used straight from them. */
+	src_raw_map(src);
+	
+	if(!s->map)
+	{
+		s->img = malloc(s->size);
+		if(!s->img)
+		{
+			ERROR("Out of memory.");
+			close(s->fd);
+			free(s);
+			return(-1);
+		}
+		
+		src->img = s->img;
+	}
+	
 	src->length = s->size;
+	s->frame = src->frame_first;
 	
 	MSG("%s opened.", src->source);
 	
@@ -119,6 +140,7 @@ int src_raw_close(src_t *src)
 {
 	src_raw_t *s = (src_raw_t *) src->state;
 	
+	if(s->map) munmap(s->map, s->map_length);
 	if(s->img) free(s->img);
 	if(s->fd >= 0) close(s->fd);
 	free(s);
@@ -126,15 +148,14 @@ int src_raw_close(src_t *src)
 	return(0);
 }
 
-int src_raw_grab(src_t *src)
+int src_raw_read(src_raw_t *s)
 {
 	int i;
-	src_raw_t *s = (src_raw_t *) src->state;
 	
 	i = s->size;
 	while(i)
 	{
-		int r = read(s->fd, s->img, i);
+		int r = read(s->fd, s->img + s->size - i, i);
 		
 		if(!r)
 		{
@@ -152,6 +173,43 @@ int src_raw_grab(src_t *src)
 		i -= r;
 	}
 	
+	s->read++;
+	
+	return(0);
+}
+
+int src_raw_grab(src_t *src)
+{
+	src_raw_t *s = (src_raw_t *) src->state;
+	
+	if(s->frame > src->frame_last)
+	{
+		MSG("Last frame reached.");
+		return(-1);
+	}
+	
+	if(s->map)
+	{
+		size_t offset = (size_t) s->frame * s->size;
+		
+		if(offset + s->size > s->map_length)
+		{
+			MSG("End of file reached.");
+			return(-1);
+		}
+		
+		src->img = s->map + offset;
+	}
+	else
+	{
+		/* Streams can only be read in order, so
+		 * read and drop any frames being skipped. */
+		while(s->read <= s->frame)
+			if(src_raw_read(s)) return(-1);
+	}
+	
+	s->frame += src->frame_step ? src->frame_step : 1;
+	
 	return(0);
 }
 
@@ -0,0 +1,386 @@
+/* fswebcam - FireStorm.cx's webcam generator                 */
+/*============================================================*/
+/* Copyright (C)2005-2011 Philip Heron <phil@sanslogic.co.uk> */
+/*                                                            */
+/* This program is distributed under the terms of the GNU     */
+/* General Public License, version 2. You may use, modify,    */
+/* and redistribute it under the terms of this license. A     */
+/* copy should be included with this source.                  */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "src.h"
+#include "record.h"
+#include "log.h"
+
+typedef struct {
+	
+	int fd;
+	
+	/* The file if it could be mapped, and
+	 * the offset of each frame within it. */
+	char *map;
+	size_t map_length;
+	size_t *index;
+	uint32_t frames;
+	
+	/* For streams, the last frame read. */
+	record_frame_t last;
+	char *img;
+	size_t img_size;
+	uint32_t read;
+	
+	/* The number of the next frame to grab. */
+	uint32_t frame;
+	
+	/* When replaying in real time, the time the first frame
+	 * was replayed and the time it was originally captured. */
+	char started;
+	struct timespec start;
+	int64_t first;
+	
+} src_replay_t;
+
+int src_replay_close(src_t *src);
+
+static int src_replay_check(record_header_t *header)
+{
+	if(memcmp(header->magic, RECORD_MAGIC, sizeof(header->magic)))
+		return(-2);
+	
+	if(header->version != RECORD_VERSION ||
+	   header->header_size != sizeof(record_frame_t))
+	{
+		ERROR("Unsupported recording version.");
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static int src_replay_map(src_t *src)
+{
+	src_replay_t *s = (src_replay_t *) src->state;
+	record_header_t header;
+	record_frame_t frame;
+	struct stat st;
+	size_t offset;
+	int r;
+	
+	if(fstat(s->fd, &st) == -1 || !S_ISREG(st.st_mode)) return(1);
+	if(st.st_size < (off_t) sizeof(header)) return(-2);
+	
+	s->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, s->fd, 0);
+	if(s->map == MAP_FAILED)
+	{
+		DEBUG("mmap: %s", strerror(errno));
+		s->map = NULL;
+		return(1);
+	}
+	
+	s->map_length = st.st_size;
+	
+	memcpy(&header, s->map, sizeof(header));
+	r = src_replay_check(&header);
+	if(r) return(r);
+	
+	/* Find the start of each frame. A frame cut short
+	 * at the end of the file is ignored. */
+	offset = sizeof(header);
+	while(offset + sizeof(record_frame_t) <= s->map_length)
+	{
+		memcpy(&frame, s->map + offset, sizeof(frame));
+		if(offset + sizeof(record_frame_t) + frame.length > s->map_length) break;
+		
+		if(!(s->frames & 0xFF))
+		{
+			size_t *index;
+			
+			index = realloc(s->index, (s->frames + 0x100) * sizeof(size_t));
+			if(!index)
+			{
+				ERROR("Out of memory.");
+				return(-1);
+			}
+			
+			s->index = index;
+		}
+		
+		s->index[s->frames++] = offset;
+		offset += sizeof(record_frame_t) + frame.length;
+	}
+	
+	if(src->frame_step <= 1)
+		madvise(s->map, s->map_length, MADV_SEQUENTIAL);
+	
+	DEBUG("Mapped %u frames.", s->frames);
+	
+	return(0);
+}
+
+static int src_replay_read_data(src_replay_t *s, void *data, size_t length)
+{
+	while(length)
+	{
+		ssize_t r = read(s->fd, data, length);
+		
+		if(!r) return(1);
+		if(r < 0)
+		{
+			ERROR("Error reading from source");
+			ERROR("read: %s", strerror(errno));
+			return(-1);
+		}
+		
+		data = (char *) data + r;
+		length -= r;
+	}
+	
+	return(0);
+}
+
+static int src_replay_read(src_replay_t *s)
+{
+	int r;
+	
+	r = src_replay_read_data(s, &s->last, sizeof(s->last));
+	
+	if(!r && s->last.length > s->img_size)
+	{
+		char *img = realloc(s->img, s->last.length);
+		
+		if(!img)
+		{
+			ERROR("Out of memory.");
+			return(-1);
+		}
+		
+		s->img = img;
+		s->img_size = s->last.length;
+	}
+	
+	if(!r) r = src_replay_read_data(s, s->img, s->last.length);
+	
+	if(r == 1) MSG("End of recording reached.");
+	if(r) return(-1);
+	
+	s->read++;
+	
+	return(0);
+}
+
+int src_replay_open(src_t *src)
+{
+	src_replay_t *s;
+	record_frame_t frame;
+	int r;
+	
+	if(!src->source)
+	{
+		ERROR("No recording was specified.");
+		return(-2);
+	}
+	
+	s = calloc(sizeof(src_replay_t), 1);
+	if(!s)
+	{
+		ERROR("Out of memory.");
+		return(-2);
+	}
+	
+	src->state = (void *) s;
+	
+	s->fd = open(src->source, O_RDONLY);
+	if(s->fd < 0)
+	{
+		ERROR("Error opening source: %s", src->source);
+		ERROR("open: %s", strerror(errno));
+		free(s);
+		return(-2);
+	}
+	
+	/* Regular files are mapped, and frames used straight from them. */
+	r = src_replay_map(src);
+	if(r > 0)
+	{
+		record_header_t header;
+		
+		if(src_replay_read_data(s, &header, sizeof(header))) r = -2;
+		else r = src_replay_check(&header);
+	}
+	
+	if(!r && s->map && !s->frames)
+	{
+		ERROR("%s: The recording is empty.", src->source);
+		r = -1;
+	}
+	
+	/* Streams are read up to the first frame to learn its size. */
+	if(!r && !s->map) r = src_replay_read(s);
+	
+	if(r)
+	{
+		src_replay_close(src);
+		return(r);
+	}
+	
+	/* The image size can't change once capture begins. */
+	if(s->map) memcpy(&frame, s->map + s->index[0], sizeof(frame));
+	else frame = s->last;
+	
+	if(src->width != frame.width || src->height != frame.height)
+	{
+		MSG("Adjusting resolution to %ix%i.", frame.width, frame.height);
+		
+		src->width  = frame.width;
+		src->height = frame.height;
+	}
+	
+	src->palette = frame.palette;
+	s->frame = src->frame_first;
+	
+	MSG("%s opened.", src->source);
+	
+	return(0);
+}
+
+int src_replay_close(src_t *src)
+{
+	src_replay_t *s = (src_replay_t *) src->state;
+	
+	if(s->map) munmap(s->map, s->map_length);
+	if(s->fd >= 0) close(s->fd);
+	free(s->index);
+	free(s->img);
+	free(s);
+	
+	return(0);
+}
+
+static void src_replay_wait(src_t *src, record_frame_t *frame)
+{
+	src_replay_t *s = (src_replay_t *) src->state;
+	struct timespec due;
+	int64_t t;
+	
+	t = frame->tv_sec * 1000000 + frame->tv_usec;
+	
+	if(!s->started)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &s->start);
+		s->first = t;
+		s->started = 1;
+		return;
+	}
+	
+	/* Wait until as long after the first frame as it was
+	 * when the frame was recorded. */
+	t -= s->first;
+	if(t <= 0) return;
+	
+	due.tv_sec  = s->start.tv_sec + t / 1000000;
+	due.tv_nsec = s->start.tv_nsec + (t % 1000000) * 1000;
+	if(due.tv_nsec >= 1000000000)
+	{
+		due.tv_sec++;
+		due.tv_nsec -= 1000000000;
+	}
+	
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+}
+
+int src_replay_grab(src_t *src)
+{
+	src_replay_t *s = (src_replay_t *) src->state;
+	record_frame_t frame;
+	char *data;
+	uint32_t i, offset;
+	
+	if(s->frame > src->frame_last)
+	{
+		MSG("Last frame reached.");
+		return(-1);
+	}
+	
+	if(s->map)
+	{
+		if(s->frame >= s->frames)
+		{
+			MSG("End of recording reached.");
+			return(-1);
+		}
+		
+		memcpy(&frame, s->map + s->index[s->frame], sizeof(frame));
+		data = s->map + s->index[s->frame] + sizeof(record_frame_t);
+	}
+	else
+	{
+		/* Streams can only be read in order, so
+		 * read and drop any frames being skipped. */
+		while(s->read <= s->frame)
+			if(src_replay_read(s)) return(-1);
+		
+		frame = s->last;
+		data = s->img;
+	}
+	
+	s->frame += src->frame_step ? src->frame_step : 1;
+	
+	if(frame.planes > SRC_MAX_PLANES)
+	{
+		ERROR("Frame has too many planes.");
+		return(-1);
+	}
+	
+	if(src->width != frame.width || src->height != frame.height)
+	{
+		ERROR("The resolution changes during the recording.");
+		return(-1);
+	}
+	
+	src->palette  = frame.palette;
+	src->sequence = frame.sequence;
+	src->planes   = frame.planes;
+	src->img      = data;
+	src->length   = frame.length;
+	
+	for(offset = i = 0; i < frame.planes; i++)
+	{
+		if(offset + frame.plane_length[i] > frame.length)
+		{
+			ERROR("Frame planes are larger than the frame.");
+			return(-1);
+		}
+		
+		src->plane[i]        = data + offset;
+		src->plane_length[i] = frame.plane_length[i];
+		src->plane_stride[i] = frame.plane_stride[i];
+		offset += frame.plane_length[i];
+	}
+	
+	if(src->planes) src->length = src->plane_length[0];
+	
+	/* Otherwise frames are replayed as fast as they can be used. */
+	if(src->realtime) src_replay_wait(src, &frame);
+	
+	return(0);
+}
+
+src_mod_t src_replay = {
+	"replay", SRC_TYPE_FILE,
+	src_replay_open,
+	src_replay_close,
+	src_replay_grab
+};
+
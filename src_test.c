@@ -12,36 +12,47 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <gd.h>
 #include "src.h"
 #include "log.h"
 
 #define PUT_RGB(d, r, g, b) { d[0] = r; d[1] = g; d[2] = b; }
 
-int src_test_open(src_t *src)
-{
-	uint8_t *p;
-	uint32_t x, y;
+/* The number of frames in the animation. The bars move along by
+ * one each frame. Frames are drawn when the source is opened, so
+ * grabbing them costs nothing. */
+#define TEST_FRAMES (8)
+
+typedef struct {
 	
-	if(src->list & SRC_LIST_INPUTS) HEAD("--- No inputs.");
-	if(src->list & SRC_LIST_TUNERS) HEAD("--- No tuners.");
-	if(src->list & SRC_LIST_FORMATS) HEAD("--- Test only supports RGB24.");
-	if(src->list & SRC_LIST_CONTROLS) HEAD("--- No controls.");
+	uint8_t *frame[TEST_FRAMES];
+	uint32_t length[TEST_FRAMES];
+	uint32_t next;
 	
-	/* Allocate memory for the test image. */
-	src->length = src->width * src->height * 3;
-	src->img    = (uint8_t *) malloc(src->length);
-	if(!src->img) return(-1);
+	/* The random delay in milliseconds added to
+	 * each frame, and the percentage dropped. */
+	uint32_t jitter;
+	uint32_t drop;
+	unsigned int seed;
 	
-	/* Set the palette type. */
-	src->palette = SRC_PAL_RGB24;
+	/* The time the next frame is due, when paced. */
+	char started;
+	struct timespec due;
+	
+} src_test_t;
+
+static void src_test_draw(src_t *src, uint8_t *p, uint32_t offset)
+{
+	uint32_t x, y;
 	
-	/* Draw the test image. */
-	p = src->img;
 	for(y = 0; y < src->height; y++)
 	{
 		for(x = 0; x < src->width; x++)
 		{
-			int i = x / (src->width / 8);
+			int i = ((x + offset) % src->width) / (src->width / 8);
 			
 			i = 7 - i;
 			
@@ -68,18 +79,431 @@ int src_test_open(src_t *src)
 			p += 3;
 		}
 	}
+}
+
+/* The reverse of the conversion used by the YUV decoders. */
+#define RGB_Y(p) ((77 * p[0] + 150 * p[1] + 29 * p[2]) >> 8)
+#define RGB_U(p) (((-43 * p[0] - 85 * p[1] + 128 * p[2]) >> 8) + 128)
+#define RGB_V(p) (((128 * p[0] - 107 * p[1] - 21 * p[2]) >> 8) + 128)
+
+static uint32_t src_test_size(src_t *src)
+{
+	uint32_t w = src->width, h = src->height;
+	
+	/* Chroma is shared between pairs of pixels, and NV12MB
+	 * is made of whole macroblocks. */
+	switch(src->palette)
+	{
+	case SRC_PAL_YUYV:
+	case SRC_PAL_UYVY:
+	case SRC_PAL_VYUY:
+	case SRC_PAL_NV16:
+		if(w & 1) return(0);
+		break;
+	case SRC_PAL_YUV420P:
+	case SRC_PAL_NV12:
+		if((w | h) & 1) return(0);
+		break;
+	case SRC_PAL_NV12MB:
+		if(w & 15 || h & 31) return(0);
+		break;
+	}
+	
+	return(src_frame_size(src->palette, w, h));
+}
+
+static int src_test_encode(src_t *src, uint8_t *rgb, int n)
+{
+	src_test_t *s = (src_test_t *) src->state;
+	gdImage *im;
+	uint32_t x, y;
+	void *img;
+	int length;
+	
+	im = gdImageCreateTrueColor(src->width, src->height);
+	if(!im)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	for(y = 0; y < src->height; y++)
+		for(x = 0; x < src->width; x++, rgb += 3)
+			gdImageSetPixel(im, x, y, gdTrueColor(rgb[0], rgb[1], rgb[2]));
+	
+	if(src->palette == SRC_PAL_PNG) img = gdImagePngPtr(im, &length);
+	else img = gdImageJpegPtr(im, &length, 90);
+	
+	gdImageDestroy(im);
+	
+	if(!img)
+	{
+		ERROR("Unable to encode the test image.");
+		return(-1);
+	}
+	
+	s->frame[n] = malloc(length);
+	if(s->frame[n])
+	{
+		memcpy(s->frame[n], img, length);
+		s->length[n] = length;
+	}
+	
+	gdFree(img);
+	
+	if(!s->frame[n])
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static void src_test_convert(src_t *src, uint8_t *rgb, uint8_t *d)
+{
+	uint32_t w = src->width, h = src->height;
+	uint16_t *d16 = (uint16_t *) d;
+	uint8_t *p, *c;
+	uint32_t x, y, i;
+	
+	switch(src->palette)
+	{
+	case SRC_PAL_RGB24:
+		memcpy(d, rgb, w * h * 3);
+		break;
+	case SRC_PAL_BGR24:
+		for(i = 0; i < w * h; i++, d += 3, rgb += 3)
+			PUT_RGB(d, rgb[2], rgb[1], rgb[0]);
+		break;
+	case SRC_PAL_RGB32:
+		for(i = 0; i < w * h; i++, d += 4, rgb += 3)
+		{
+			PUT_RGB(d, rgb[0], rgb[1], rgb[2]);
+			d[3] = 0xFF;
+		}
+		break;
+	case SRC_PAL_BGR32:
+	case SRC_PAL_ABGR32:
+		for(i = 0; i < w * h; i++, d += 4, rgb += 3)
+		{
+			PUT_RGB(d, rgb[2], rgb[1], rgb[0]);
+			d[3] = 0xFF;
+		}
+		break;
+	case SRC_PAL_RGB565:
+		for(i = 0; i < w * h; i++, rgb += 3)
+			*(d16++) = ((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3);
+		break;
+	case SRC_PAL_RGB555:
+		for(i = 0; i < w * h; i++, rgb += 3)
+			*(d16++) = ((rgb[0] >> 3) << 10) | ((rgb[1] >> 3) << 5) | (rgb[2] >> 3);
+		break;
+	case SRC_PAL_Y16:
+		for(i = 0; i < w * h; i++, rgb += 3)
+			*(d16++) = RGB_Y(rgb) * 0x101;
+		break;
+	case SRC_PAL_GREY:
+		for(i = 0; i < w * h; i++, rgb += 3)
+			*(d++) = RGB_Y(rgb);
+		break;
+	case SRC_PAL_YUYV:
+	case SRC_PAL_UYVY:
+	case SRC_PAL_VYUY:
+		/* The chroma is taken from the first pixel of each pair. */
+		for(i = 0; i < w * h; i += 2, d += 4, rgb += 6)
+		{
+			uint8_t y0 = RGB_Y(rgb), y1 = RGB_Y((rgb + 3));
+			uint8_t u = RGB_U(rgb), v = RGB_V(rgb);
+			
+			if(src->palette == SRC_PAL_YUYV)
+			{
+				d[0] = y0; d[1] = u; d[2] = y1; d[3] = v;
+			}
+			else if(src->palette == SRC_PAL_UYVY)
+			{
+				d[0] = u; d[1] = y0; d[2] = v; d[3] = y1;
+			}
+			else
+			{
+				d[0] = v; d[1] = y0; d[2] = u; d[3] = y1;
+			}
+		}
+		break;
+	case SRC_PAL_YUV420P:
+		for(i = 0, p = rgb; i < w * h; i++, p += 3) *(d++) = RGB_Y(p);
+		
+		/* The chroma is taken from the top left of each 2x2 block. */
+		c = d + (w / 2) * (h / 2);
+		for(y = 0; y < h; y += 2)
+			for(x = 0; x < w; x += 2)
+			{
+				p = rgb + (y * w + x) * 3;
+				*(d++) = RGB_U(p);
+				*(c++) = RGB_V(p);
+			}
+		break;
+	case SRC_PAL_NV12:
+	case SRC_PAL_NV16:
+		for(i = 0, p = rgb; i < w * h; i++, p += 3) *(d++) = RGB_Y(p);
+		
+		for(y = 0; y < h; y += (src->palette == SRC_PAL_NV12 ? 2 : 1))
+			for(x = 0; x < w; x += 2)
+			{
+				p = rgb + (y * w + x) * 3;
+				*(d++) = RGB_U(p);
+				*(d++) = RGB_V(p);
+			}
+		break;
+	case SRC_PAL_NV12MB:
+		/* Both planes are stored in 16x16 byte tiles, with
+		 * the chroma at half the height of the image. */
+		c = d + w * h;
+		for(y = 0, p = rgb; y < h; y++)
+			for(x = 0; x < w; x++, p += 3)
+			{
+				uint32_t bx = x >> 4, by = y >> 4;
+				
+				d[(by * (w >> 4) + bx) * 0x100 + (y & 15) * 0x10 + (x & 15)] = RGB_Y(p);
+				
+				if((x | y) & 1) continue;
+				
+				by = y >> 5;
+				i  = (by * (w >> 4) + bx) * 0x100 + ((y / 2) & 15) * 0x10 + (x & 15);
+				c[i]     = RGB_U(p);
+				c[i + 1] = RGB_V(p);
+			}
+		break;
+	case SRC_PAL_BAYER:
+	case SRC_PAL_SBGGR8:
+	case SRC_PAL_SRGGB8:
+	case SRC_PAL_SGBRG8:
+	case SRC_PAL_SGRBG8:
+		/* Follows the layouts described in dec_bayer.c. */
+		for(y = 0; y < h; y++)
+			for(x = 0; x < w; x++, rgb += 3)
+			{
+				int green, red;
+				
+				if(src->palette == SRC_PAL_SGBRG8 ||
+				   src->palette == SRC_PAL_SGRBG8)
+					green = ~(x + y) & 1;
+				else green = (x + y) & 1;
+				
+				red = y & 1;
+				if(src->palette == SRC_PAL_SRGGB8 ||
+				   src->palette == SRC_PAL_SGRBG8) red = !red;
+				
+				if(green)    *(d++) = rgb[1];
+				else if(red) *(d++) = rgb[0];
+				else         *(d++) = rgb[2];
+			}
+		break;
+	}
+}
+
+int src_test_set_controls(src_t *src)
+{
+	src_test_t *s = (src_test_t *) src->state;
+	char *value;
+	
+	if(src->list & SRC_LIST_CONTROLS)
+	{
+		HEAD("--- Available controls:");
+		MSG("%-25s %-15u 0 - 10000", "jitter", s->jitter);
+		MSG("%-25s %-15u 0 - 100", "drop", s->drop);
+	}
+	
+	/* The most a frame is delayed, in milliseconds. */
+	if(!src_get_option_by_name(src->option, "jitter", &value))
+		s->jitter = strtoul(value, NULL, 10);
+	
+	/* The percentage of frames to drop. */
+	if(!src_get_option_by_name(src->option, "drop", &value))
+		s->drop = strtoul(value, NULL, 10);
+	
+	if(s->jitter > 10000) s->jitter = 10000;
+	if(s->drop > 99) s->drop = 99;
 	
 	return(0);
 }
 
 int src_test_close(src_t *src)
 {
-	free(src->img);
+	src_test_t *s = (src_test_t *) src->state;
+	int i;
+	
+	for(i = 0; i < TEST_FRAMES; i++) free(s->frame[i]);
+	free(s);
+	
 	return(0);
 }
 
+int src_test_open(src_t *src)
+{
+	src_test_t *s;
+	uint8_t *rgb;
+	uint32_t length = 0;
+	int i, r = 0;
+	
+	if(src->list & SRC_LIST_INPUTS) HEAD("--- No inputs.");
+	if(src->list & SRC_LIST_TUNERS) HEAD("--- No tuners.");
+	if(src->list & SRC_LIST_FORMATS)
+		HEAD("--- Test supports every palette but S561.");
+	
+	if(src->width < 8 || src->height < 2)
+	{
+		ERROR("The test image must be at least 8x2.");
+		return(-1);
+	}
+	
+	/* Set the palette type. */
+	if(src->palette == SRC_PAL_ANY) src->palette = SRC_PAL_RGB24;
+	
+	if(src->palette != SRC_PAL_JPEG &&
+	   src->palette != SRC_PAL_MJPEG &&
+	   src->palette != SRC_PAL_PNG)
+	{
+		length = src_test_size(src);
+		if(!length)
+		{
+			ERROR("Test source can't draw %s at %ix%i.",
+			      src_palette[src->palette].name,
+			      src->width, src->height);
+			return(-1);
+		}
+	}
+	
+	s = calloc(sizeof(src_test_t), 1);
+	if(!s)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	src->state = (void *) s;
+	s->seed = time(NULL);
+	
+	/* Draw the test images. */
+	rgb = malloc(src->width * src->height * 3);
+	if(!rgb)
+	{
+		ERROR("Out of memory.");
+		r = -1;
+	}
+	
+	for(i = 0; !r && i < TEST_FRAMES; i++)
+	{
+		src_test_draw(src, rgb, src->width * i / TEST_FRAMES);
+		
+		if(!length)
+		{
+			r = src_test_encode(src, rgb, i);
+			continue;
+		}
+		
+		s->frame[i] = malloc(length);
+		if(!s->frame[i])
+		{
+			ERROR("Out of memory.");
+			r = -1;
+			break;
+		}
+		
+		src_test_convert(src, rgb, s->frame[i]);
+		s->length[i] = length;
+	}
+	
+	free(rgb);
+	
+	if(r)
+	{
+		src_test_close(src);
+		return(-1);
+	}
+	
+	src_test_set_controls(src);
+	
+	src->img    = s->frame[0];
+	src->length = s->length[0];
+	
+	return(0);
+}
+
+static void src_test_wait(src_t *src)
+{
+	src_test_t *s = (src_test_t *) src->state;
+	struct timespec now, t;
+	long period = 0;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	
+	if(src->fps) period = 1000000000L / src->fps;
+	
+	if(!period || !s->started)
+	{
+		s->due = now;
+		s->started = 1;
+	}
+	
+	/* Like a device with one buffer, frames due while nobody
+	 * was waiting for them are lost. */
+	while(period && (now.tv_sec - s->due.tv_sec) * 1000000000L +
+	      now.tv_nsec - s->due.tv_nsec >= period)
+	{
+		s->due.tv_nsec += period;
+		if(s->due.tv_nsec >= 1000000000L)
+		{
+			s->due.tv_sec++;
+			s->due.tv_nsec -= 1000000000L;
+		}
+		
+		src->sequence++;
+	}
+	
+	/* Deliver the frame up to jitter milliseconds late. */
+	t = s->due;
+	if(s->jitter)
+	{
+		t.tv_nsec += (rand_r(&s->seed) % (s->jitter * 1000)) * 1000L;
+		t.tv_sec  += t.tv_nsec / 1000000000L;
+		t.tv_nsec %= 1000000000L;
+	}
+	
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR);
+	
+	/* Stamp the frame with the time it was due. */
+	src->timestamp.tv_sec  = s->due.tv_sec;
+	src->timestamp.tv_usec = s->due.tv_nsec / 1000;
+	
+	s->due.tv_nsec += period;
+	if(s->due.tv_nsec >= 1000000000L)
+	{
+		s->due.tv_sec++;
+		s->due.tv_nsec -= 1000000000L;
+	}
+}
+
 int src_test_grab(src_t *src)
 {
+	src_test_t *s = (src_test_t *) src->state;
+	
+	/* Dropped frames are skipped in the sequence, and
+	 * take up a frame period when the source is paced. */
+	while(s->drop && rand_r(&s->seed) % 100 < s->drop)
+	{
+		if(src->fps || s->jitter) src_test_wait(src);
+		src->sequence++;
+		s->next++;
+	}
+	
+	if(src->fps || s->jitter) src_test_wait(src);
+	
+	src->sequence++;
+	src->img    = s->frame[s->next % TEST_FRAMES];
+	src->length = s->length[s->next % TEST_FRAMES];
+	s->next++;
+	
 	return(0);
 }
 
@@ -87,6 +511,7 @@ src_mod_t src_test = {
 	"test", SRC_TYPE_NONE,
 	src_test_open,
 	src_test_close,
-	src_test_grab
+	src_test_grab,
+	src_test_set_controls
 };
 
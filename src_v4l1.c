@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <poll.h>
 #include "videodev.h"
 #include "videodev_mjpeg.h"
 #include "src.h"
@@ -851,6 +852,34 @@ int src_v4l_grab_mjpeg(src_t *src)
 	return(0);
 }
 
+int src_v4l_wait(src_t *src)
+{
+	src_v4l_t *s = (src_v4l_t *) src->state;
+	struct pollfd pfd;
+	int r;
+	
+	/* Is a frame ready? With no timeout, block until it is. */
+	pfd.fd     = s->fd;
+	pfd.events = POLLIN;
+	
+	do r = poll(&pfd, 1, src->timeout ? (int) src->timeout : -1);
+	while(r == -1 && errno == EINTR);
+	
+	if(r == -1)
+	{
+		ERROR("poll: %s", strerror(errno));
+		return(-1);
+	}
+	
+	if(!r)
+	{
+		ERROR("Timed out waiting for frame!");
+		return(-1);
+	}
+	
+	return(0);
+}
+
 static int src_v4l_grab(src_t *src)
 {
 	src_v4l_t *s = (src_v4l_t *) src->state;
@@ -859,33 +888,7 @@ static int src_v4l_grab(src_t *src)
 	if(src->palette == SRC_PAL_JPEG) return(src_v4l_grab_mjpeg(src));
 	
 	/* Wait for a frame. */
-	if(src->timeout)
-	{
-		fd_set fds;
-		struct timeval tv;
-		int r;
-		
-		/* Is a frame ready? */
-		FD_ZERO(&fds);
-		FD_SET(s->fd, &fds);
-		
-		tv.tv_sec = src->timeout;
-		tv.tv_usec = 0;
-		
-		r = select(s->fd + 1, &fds, NULL, NULL, &tv);
-		
-		if(r == -1)
-		{
-			ERROR("select: %s", strerror(errno));
-			return(-1);
-		}
-		
-		if(!r)
-		{
-			ERROR("Timed out waiting for frame!");
-			return(-1);
-		}
-	}
+	if(src_v4l_wait(src)) return(-1);
 	
 	/* If using mmap... */
 	if(s->map)
@@ -17,8 +17,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <poll.h>
+#include <time.h>
 #include "videodev2.h"
 #include "src.h"
 #include "log.h"
@@ -28,25 +31,87 @@
 typedef struct {
 	void *start;
 	size_t length;
+	int dmabuf;
 } v4l2_buffer_t;
 
 typedef struct {
 	
 	int fd;
 	char map;
+	uint32_t type;
+	uint32_t memory;
+	uint8_t planes;
 	
 	struct v4l2_capability cap;
 	struct v4l2_format fmt;
 	struct v4l2_requestbuffers req;
 	struct v4l2_buffer buf;
+	struct v4l2_plane plane[VIDEO_MAX_PLANES];
 	
+	/* One entry for each plane of each buffer. */
 	v4l2_buffer_t *buffer;
 	
 	int pframe;
 	
+	/* The device's controls and their menu items. */
+	char controls_loaded;
+	uint32_t ctrls;
+	struct v4l2_queryctrl *ctrl;
+	uint32_t menus;
+	struct v4l2_querymenu *menu;
+	
+	/* Set if the format was loaded from the cache. */
+	char cached;
+	
+	/* The device's crop area before it was changed, if it was. */
+	char crop_set;
+	struct v4l2_rect crop_orig;
+	
+	/* Set if the device will report source changes and end of stream. */
+	char events;
+	
+	/* Set while streaming slowly between captures, with
+	 * the frame interval to return to. */
+	char standby;
+	struct v4l2_fract interval;
+	
 } src_v4l2_t;
 
+/* The cache file starts with this header, followed by the
+ * control and menu item structures. */
+typedef struct {
+	
+	char     magic[8];
+	uint32_t size;
+	
+	/* The device... */
+	uint8_t  driver[16];
+	uint8_t  card[32];
+	uint8_t  bus_info[32];
+	uint32_t version;
+	uint32_t type;
+	
+	/* ...the format that was asked for... */
+	int32_t  palette;
+	uint32_t width;
+	uint32_t height;
+	uint32_t auto_mode;
+	uint32_t palette_policy;
+	
+	/* ...and what the device gave. */
+	int32_t  src_palette;
+	struct v4l2_format fmt;
+	
+	uint32_t ctrls;
+	uint32_t menus;
+	
+} src_v4l2_cache_t;
+
+#define SRC_V4L2_CACHE_MAGIC "fswc-c3"
+
 static int src_v4l2_close(src_t *src);
+int src_v4l2_requeue(src_t *src);
+int src_v4l2_drain(src_t *src);
 
 typedef struct {
 	uint16_t src;
@@ -66,6 +131,11 @@ v4l2_palette_t v4l2_palette[] = {
 	{ SRC_PAL_UYVY,    V4L2_PIX_FMT_UYVY   },
 	{ SRC_PAL_VYUY,    V4L2_PIX_FMT_VYUY   },
 	{ SRC_PAL_YUV420P, V4L2_PIX_FMT_YUV420 },
+	{ SRC_PAL_YUV420P, V4L2_PIX_FMT_YUV420M },
+	{ SRC_PAL_NV12,    V4L2_PIX_FMT_NV12   },
+	{ SRC_PAL_NV12,    V4L2_PIX_FMT_NV12M  },
+	{ SRC_PAL_NV16,    V4L2_PIX_FMT_NV16   },
+	{ SRC_PAL_NV16,    V4L2_PIX_FMT_NV16M  },
 	{ SRC_PAL_BAYER,   V4L2_PIX_FMT_SBGGR8 },
 	{ SRC_PAL_SBGGR8,  V4L2_PIX_FMT_SBGGR8 },
 	{ SRC_PAL_SRGGB8,  V4L2_PIX_FMT_SRGGB8 },
@@ -94,6 +164,7 @@ int src_v4l2_get_capability(src_t *src)
 	DEBUG("cap.bus_info: \"%s\"", s->cap.bus_info);
 	DEBUG("cap.capabilities=0x%08X", s->cap.capabilities);
 	if(s->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE) DEBUG("- VIDEO_CAPTURE");
+	if(s->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE) DEBUG("- VIDEO_CAPTURE_MPLANE");
 	if(s->cap.capabilities & V4L2_CAP_VIDEO_OUTPUT)  DEBUG("- VIDEO_OUTPUT");
 	if(s->cap.capabilities & V4L2_CAP_VIDEO_OVERLAY) DEBUG("- VIDEO_OVERLAY");
 	if(s->cap.capabilities & V4L2_CAP_VBI_CAPTURE)   DEBUG("- VBI_CAPTURE");
@@ -107,7 +178,12 @@ int src_v4l2_get_capability(src_t *src)
 	if(s->cap.capabilities & V4L2_CAP_STREAMING)     DEBUG("- STREAMING");
 	if(s->cap.capabilities & V4L2_CAP_TIMEPERFRAME)  DEBUG("- TIMEPERFRAME");
 	
-	if(!s->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)
+	/* Prefer the single-planar API if the device supports both. */
+	if(s->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)
+		s->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	else if(s->cap.capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
+		s->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	else
 	{
 		ERROR("Device does not support capturing.");
 		return(-1);
@@ -116,6 +192,31 @@ int src_v4l2_get_capability(src_t *src)
 	return(0);
 }
 
+int src_v4l2_select_input(src_t *src, int i)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	enum v4l2_buf_type type = s->type;
+	int e;
+	
+	if(!ioctl(s->fd, VIDIOC_S_INPUT, &i)) return(0);
+	
+	/* Some drivers can only change input while stopped. */
+	if(errno != EBUSY || !s->map) return(-1);
+	
+	if(ioctl(s->fd, VIDIOC_STREAMOFF, &type) == -1) return(-1);
+	
+	if(ioctl(s->fd, VIDIOC_S_INPUT, &i) == -1)
+	{
+		e = errno;
+		src_v4l2_requeue(src);
+		errno = e;
+		
+		return(-1);
+	}
+	
+	return(src_v4l2_requeue(src));
+}
+
 int src_v4l2_set_input(src_t *src)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
@@ -202,7 +303,7 @@ int src_v4l2_set_input(src_t *src)
 	if(input.status & V4L2_IN_ST_NO_ACCESS) DEBUG("- NO_ACCESS");
 	if(input.status & V4L2_IN_ST_VTR) DEBUG("- VTR");
 	
-	if(ioctl(s->fd, VIDIOC_S_INPUT, &i) == -1)
+	if(src_v4l2_select_input(src, i))
 	{
 		ERROR("Error selecting input %i", i);
 		ERROR("VIDIOC_S_INPUT: %s", strerror(errno));
@@ -371,11 +472,12 @@ int src_v4l2_show_control(src_t *src, struct v4l2_queryctrl *queryctrl)
 	return(0);
 }
 
-int src_v4l2_set_control(src_t *src, struct v4l2_queryctrl *queryctrl)
+int src_v4l2_set_control(src_t *src, struct v4l2_queryctrl *queryctrl,
+                         struct v4l2_ext_control *control)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
-	struct v4l2_control control;
-	struct v4l2_querymenu querymenu;
+	struct v4l2_querymenu *querymenu;
+	uint32_t m;
 	char *sv;
 	int iv;
 	
@@ -383,10 +485,9 @@ int src_v4l2_set_control(src_t *src, struct v4l2_queryctrl *queryctrl)
 	if(src_get_option_by_name(src->option, (char *) queryctrl->name, &sv))
 		return(0);
 	
-	memset(&querymenu, 0, sizeof(querymenu));
-	memset(&control, 0, sizeof(control));
+	memset(control, 0, sizeof(*control));
 	
-	control.id = queryctrl->id;
+	control->id = queryctrl->id;
 	
 	switch(queryctrl->type)
 	{
@@ -409,8 +510,7 @@ int src_v4l2_set_control(src_t *src, struct v4l2_queryctrl *queryctrl)
 		if(iv < queryctrl->minimum || iv > queryctrl->maximum)
 			WARN("Value is out of range. Setting anyway.");
 		
-		control.value = iv;
-		ioctl(s->fd, VIDIOC_S_CTRL, &control);
+		control->value = iv;
 		break;
 	
 	case V4L2_CTRL_TYPE_BOOLEAN:
@@ -428,508 +528,2011 @@ int src_v4l2_set_control(src_t *src, struct v4l2_queryctrl *queryctrl)
 		
 		MSG("Setting %s to %s (%i).", queryctrl->name, sv, iv);
 		
-		control.value = iv;
-		ioctl(s->fd, VIDIOC_S_CTRL, &control);
+		control->value = iv;
 		
 		break;
 	
 	case V4L2_CTRL_TYPE_MENU:
 		
 		/* Scan for a matching value. */
-		querymenu.id = queryctrl->id;
-		
-		for(iv = queryctrl->minimum; iv <= queryctrl->maximum; iv++)
+		for(m = 0; m < s->menus; m++)
 		{
-			querymenu.index = iv;
-			
-			if(ioctl(s->fd, VIDIOC_QUERYMENU, &querymenu))
-			{
-				ERROR("Error querying menu.");
-				continue;
-			}
+			querymenu = &s->menu[m];
 			
-			if(!strncasecmp((char *) querymenu.name, sv, 32))
-				break;
+			if(querymenu->id != queryctrl->id) continue;
+			if(!strncasecmp((char *) querymenu->name, sv, 32)) break;
 		}
 		
-		if(iv > queryctrl->maximum)
+		if(m == s->menus)
 		{
 			MSG("Unknown value '%s' for %s.", sv, queryctrl->name);
 			return(-1);
 		}
 		
+		iv = querymenu->index;
+		
 		MSG("Setting %s to %s (%i).",
-		    queryctrl->name, querymenu.name, iv);
+		    queryctrl->name, querymenu->name, iv);
 		
-		control.value = iv;
-		ioctl(s->fd, VIDIOC_S_CTRL, &control);
+		control->value = iv;
 		
 		break;
 	
 	case V4L2_CTRL_TYPE_BUTTON:
 		
 		MSG("Triggering %s control.", queryctrl->name);
-		ioctl(s->fd, VIDIOC_S_CTRL, &control);
 		
 		break;
 	
 	default:
 		WARN("Not setting unknown control type %i (%s).",
-		     queryctrl->name);
-		break;
+		     queryctrl->type, queryctrl->name);
+		return(0);
 	}
 	
-	return(0);
+	/* The control is to be written. */
+	return(1);
 }
 
-int src_v4l2_set_controls(src_t *src)
+int src_v4l2_drop_unchanged(src_t *src, struct v4l2_ext_control *ctrl,
+                            struct v4l2_queryctrl **query, uint32_t *count)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
-	struct v4l2_queryctrl queryctrl;
+	struct v4l2_ext_controls ext;
+	struct v4l2_ext_control *cur;
+	uint32_t i, j, n;
 	
-	memset(&queryctrl, 0, sizeof(queryctrl));
+	cur = calloc(*count, sizeof(struct v4l2_ext_control));
+	if(!cur)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
 	
-	if(src->list & SRC_LIST_CONTROLS)
+	/* Buttons and write-only controls can't be read back. */
+	for(n = i = 0; i < *count; i++)
 	{
-		HEAD("%-25s %-15s %s", "Available Controls", "Current Value", "Range");
-		MSG("%-25s %-15s %s",  "------------------", "-------------", "-----");
+		if(query[i]->type == V4L2_CTRL_TYPE_BUTTON) continue;
+		if(query[i]->flags & V4L2_CTRL_FLAG_WRITE_ONLY) continue;
+		cur[n++].id = ctrl[i].id;
+	}
+	
+	/* Read the current values, one control class at a time. */
+	for(i = 0; i < n; i = j)
+	{
+		for(j = i; j < n && V4L2_CTRL_ID2CLASS(cur[j].id) ==
+		    V4L2_CTRL_ID2CLASS(cur[i].id); j++);
 		
-		/* Display all controls */
-		queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
-		while (0 == ioctl(s->fd, VIDIOC_QUERYCTRL, &queryctrl))
+		memset(&ext, 0, sizeof(ext));
+		ext.ctrl_class = V4L2_CTRL_ID2CLASS(cur[i].id);
+		ext.count      = j - i;
+		ext.controls   = &cur[i];
+		
+		if(ioctl(s->fd, VIDIOC_G_EXT_CTRLS, &ext) == -1)
 		{
-			src_v4l2_show_control(src, &queryctrl);
-			queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+			/* Assume all of these have changed. */
+			DEBUG("VIDIOC_G_EXT_CTRLS: %s", strerror(errno));
+			memmove(&cur[i], &cur[j], sizeof(*cur) * (n - j));
+			n -= j - i;
+			j = i;
 		}
 	}
 	
-	/* Set all controls */
-	queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
-	while (0 == ioctl(s->fd, VIDIOC_QUERYCTRL, &queryctrl))
+	/* Remove each control already set to its new value. */
+	for(i = j = 0; i < *count; i++)
 	{
-		src_v4l2_set_control(src, &queryctrl);
-		queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+		uint32_t c;
+		
+		for(c = 0; c < n && cur[c].id != ctrl[i].id; c++);
+		
+		if(c < n && cur[c].value == ctrl[i].value)
+		{
+			DEBUG("%s is unchanged.", query[i]->name);
+			continue;
+		}
+		
+		ctrl[j]  = ctrl[i];
+		query[j] = query[i];
+		j++;
 	}
+	
+	*count = j;
+	free(cur);
+	
 	return(0);
 }
 
-int src_v4l2_set_pix_format(src_t *src)
+int src_v4l2_write_controls(src_t *src, struct v4l2_ext_control *ctrl,
+                            uint32_t count)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
-	struct v4l2_fmtdesc fmt;
-	int v4l2_pal;
+	struct v4l2_ext_controls ext;
+	uint32_t i, j;
 	
-	/* Dump a list of formats the device supports. */
-	DEBUG("Device offers the following V4L2 pixel formats:");
-	
-	v4l2_pal = 0;
-	memset(&fmt, 0, sizeof(fmt));
-	fmt.index = v4l2_pal;
-	fmt.type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	
-	while(ioctl(s->fd, VIDIOC_ENUM_FMT, &fmt) != -1)
+	/* Write each control class in one go. */
+	for(i = 0; i < count; i = j)
 	{
-		DEBUG("%i: [0x%08X] '%c%c%c%c' (%s)", v4l2_pal,
-		      fmt.pixelformat,
-		      fmt.pixelformat >> 0,  fmt.pixelformat >> 8,
-		      fmt.pixelformat >> 16, fmt.pixelformat >> 24,
-		      fmt.description);
+		for(j = i; j < count && V4L2_CTRL_ID2CLASS(ctrl[j].id) ==
+		    V4L2_CTRL_ID2CLASS(ctrl[i].id); j++);
 		
-		memset(&fmt, 0, sizeof(fmt));
-		fmt.index = ++v4l2_pal;
-		fmt.type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	}
-	
-	/* Step through each palette type. */
-	v4l2_pal = 0;
-	
-	if(src->palette != SRC_PAL_ANY)
-	{
-		while(v4l2_palette[v4l2_pal].v4l2)
-		{
-			if(v4l2_palette[v4l2_pal].src == src->palette) break;
-			v4l2_pal++;
-		}
+		memset(&ext, 0, sizeof(ext));
+		ext.ctrl_class = V4L2_CTRL_ID2CLASS(ctrl[i].id);
+		ext.count      = j - i;
+		ext.controls   = &ctrl[i];
 		
-		if(!v4l2_palette[v4l2_pal].v4l2)
+		if(!ioctl(s->fd, VIDIOC_S_EXT_CTRLS, &ext)) continue;
+		
+		DEBUG("VIDIOC_S_EXT_CTRLS: %s", strerror(errno));
+		
+		/* Fall back to setting them one at a time. */
+		for(; i < j; i++)
 		{
-			ERROR("Unable to handle palette format %s.",
-			      src_palette[src->palette]);
+			struct v4l2_control control;
 			
-			return(-1);
+			control.id    = ctrl[i].id;
+			control.value = ctrl[i].value;
+			
+			if(ioctl(s->fd, VIDIOC_S_CTRL, &control) == -1)
+				WARN("VIDIOC_S_CTRL: %s", strerror(errno));
 		}
 	}
 	
-	while(v4l2_palette[v4l2_pal].v4l2)
+	return(0);
+}
+
+int src_v4l2_load_controls(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_queryctrl queryctrl;
+	struct v4l2_querymenu querymenu;
+	void *n;
+	int i;
+	
+	s->controls_loaded = -1;
+	
+	memset(&queryctrl, 0, sizeof(queryctrl));
+	queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+	
+	while(!ioctl(s->fd, VIDIOC_QUERYCTRL, &queryctrl))
 	{
-		/* Try the palette... */
-		memset(&s->fmt, 0, sizeof(s->fmt));
-		s->fmt.type                = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		s->fmt.fmt.pix.width       = src->width;
-		s->fmt.fmt.pix.height      = src->height;
-		s->fmt.fmt.pix.pixelformat = v4l2_palette[v4l2_pal].v4l2;
-		s->fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+		n = realloc(s->ctrl, sizeof(queryctrl) * (s->ctrls + 1));
+		if(!n)
+		{
+			ERROR("Out of memory.");
+			return(-1);
+		}
+		
+		s->ctrl = n;
+		s->ctrl[s->ctrls++] = queryctrl;
 		
-		if(ioctl(s->fd, VIDIOC_TRY_FMT, &s->fmt) != -1 &&
-		   s->fmt.fmt.pix.pixelformat == v4l2_palette[v4l2_pal].v4l2)
+		/* Keep the names of each menu item. */
+		for(i = queryctrl.minimum;
+		    queryctrl.type == V4L2_CTRL_TYPE_MENU &&
+		    i <= queryctrl.maximum; i++)
 		{
-			src->palette = v4l2_palette[v4l2_pal].src;
+			memset(&querymenu, 0, sizeof(querymenu));
+			querymenu.id    = queryctrl.id;
+			querymenu.index = i;
 			
-			INFO("Using palette %s", src_palette[src->palette].name);
+			if(ioctl(s->fd, VIDIOC_QUERYMENU, &querymenu)) continue;
 			
-			if(s->fmt.fmt.pix.width != src->width ||
-			   s->fmt.fmt.pix.height != src->height)
+			n = realloc(s->menu, sizeof(querymenu) * (s->menus + 1));
+			if(!n)
 			{
-				MSG("Adjusting resolution from %ix%i to %ix%i.",
-				    src->width, src->height,
-				    s->fmt.fmt.pix.width,
-				    s->fmt.fmt.pix.height);
-				src->width = s->fmt.fmt.pix.width;
-				src->height = s->fmt.fmt.pix.height;
-                        }
-			
-			if(ioctl(s->fd, VIDIOC_S_FMT, &s->fmt) == -1)
-			{
-				ERROR("Error setting pixel format.");
-				ERROR("VIDIOC_S_FMT: %s", strerror(errno));
+				ERROR("Out of memory.");
 				return(-1);
 			}
 			
-			if(v4l2_palette[v4l2_pal].v4l2 == V4L2_PIX_FMT_MJPEG)
-			{
-				struct v4l2_jpegcompression jpegcomp;
-				
-				memset(&jpegcomp, 0, sizeof(jpegcomp));
-				ioctl(s->fd, VIDIOC_G_JPEGCOMP, &jpegcomp);
-				jpegcomp.jpeg_markers |= V4L2_JPEG_MARKER_DHT;
-				ioctl(s->fd, VIDIOC_S_JPEGCOMP, &jpegcomp);
-			}
-			
-			return(0);
+			s->menu = n;
+			s->menu[s->menus++] = querymenu;
 		}
 		
-		if(src->palette != SRC_PAL_ANY) break;
-		
-		v4l2_pal++;
+		queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
 	}
 	
-	ERROR("Unable to find a compatible palette format.");
-	
-	return(-1);
+	return(0);
 }
 
-int src_v4l2_set_fps(src_t *src)
+int src_v4l2_set_controls(src_t *src)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
-	struct v4l2_streamparm setfps;
+	struct v4l2_queryctrl queryctrl;
+	struct v4l2_queryctrl **query;
+	struct v4l2_ext_control *ctrl;
+	uint32_t i, count;
 	
-	memset(&setfps, 0, sizeof(setfps));
+	memset(&queryctrl, 0, sizeof(queryctrl));
 	
-	setfps.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	setfps.parm.capture.timeperframe.numerator = 1;
-	setfps.parm.capture.timeperframe.denominator = src->fps;
-	if(ioctl(s->fd, VIDIOC_S_PARM, &setfps) == -1)
+	if(src->list & SRC_LIST_CONTROLS)
 	{
-		/* Not fatal - just warn about it */
-		WARN("Error setting frame rate:");
-		WARN("VIDIOC_S_PARM: %s", strerror(errno));
+		HEAD("%-25s %-15s %s", "Available Controls", "Current Value", "Range");
+		MSG("%-25s %-15s %s",  "------------------", "-------------", "-----");
+		
+		/* Display all controls */
+		queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+		while (0 == ioctl(s->fd, VIDIOC_QUERYCTRL, &queryctrl))
+		{
+			src_v4l2_show_control(src, &queryctrl);
+			queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+		}
+	}
+	
+	/* Nothing more to do if no controls are being set. */
+	if(!src->option || !*src->option) return(0);
+	
+	if(!s->controls_loaded && src_v4l2_load_controls(src)) return(-1);
+	
+	ctrl  = calloc(s->ctrls, sizeof(struct v4l2_ext_control));
+	query = calloc(s->ctrls, sizeof(struct v4l2_queryctrl *));
+	if(!ctrl || !query)
+	{
+		ERROR("Out of memory.");
+		free(ctrl);
+		free(query);
 		return(-1);
 	}
 	
+	/* Gather the new value of each control being set. */
+	for(count = i = 0; i < s->ctrls; i++)
+	{
+		if(src_v4l2_set_control(src, &s->ctrl[i], &ctrl[count]) != 1)
+			continue;
+		
+		query[count++] = &s->ctrl[i];
+	}
+	
+	/* Only write the controls that have changed. */
+	if(count) src_v4l2_drop_unchanged(src, ctrl, query, &count);
+	if(count) src_v4l2_write_controls(src, ctrl, count);
+	
+	free(ctrl);
+	free(query);
+	
 	return(0);
 }
 
-int src_v4l2_free_mmap(src_t *src)
+void src_v4l2_format_set(src_t *src, uint32_t pixelformat)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
-	int i;
 	
-	for(i = 0; i < s->req.count; i++)
-		munmap(s->buffer[i].start, s->buffer[i].length);
+	s->planes = 1;
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+	{
+		s->planes = s->fmt.fmt.pix_mp.num_planes;
+		DEBUG("Format has %i planes.", s->planes);
+	}
 	
-	return(0);
+	if(pixelformat == V4L2_PIX_FMT_MJPEG)
+	{
+		struct v4l2_jpegcompression jpegcomp;
+		
+		memset(&jpegcomp, 0, sizeof(jpegcomp));
+		ioctl(s->fd, VIDIOC_G_JPEGCOMP, &jpegcomp);
+		jpegcomp.jpeg_markers |= V4L2_JPEG_MARKER_DHT;
+		ioctl(s->fd, VIDIOC_S_JPEGCOMP, &jpegcomp);
+	}
 }
 
-int src_v4l2_set_mmap(src_t *src)
+char *src_v4l2_cache_path(src_t *src)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
-	enum v4l2_buf_type type;
-	uint32_t b;
+	char *path, *p;
 	
-	/* Does the device support streaming? */
-	if(~s->cap.capabilities & V4L2_CAP_STREAMING) return(-1);
+	path = malloc(strlen(src->cache) + sizeof(s->cap.driver) +
+	              sizeof(s->cap.bus_info) + 10);
+	if(!path)
+	{
+		ERROR("Out of memory.");
+		return(NULL);
+	}
 	
-	memset(&s->req, 0, sizeof(s->req));
+	p = path + sprintf(path, "%s/", src->cache);
+	p += sprintf(p, "%.16s-%.32s", s->cap.driver, s->cap.bus_info);
+	strcpy(p, ".cache");
 	
-	s->req.count  = 4;
-	s->req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	s->req.memory = V4L2_MEMORY_MMAP;
+	/* Keep the device's name safe for use as a filename. */
+	for(p = path + strlen(src->cache) + 1; *p; p++)
+		if(!isalnum(*p) && *p != '-' && *p != '.') *p = '_';
 	
-	if(ioctl(s->fd, VIDIOC_REQBUFS, &s->req) == -1)
+	return(path);
+}
+
+int src_v4l2_load_cache(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	src_v4l2_cache_t c;
+	char *path;
+	FILE *f;
+	
+	path = src_v4l2_cache_path(src);
+	if(!path) return(-1);
+	
+	f = fopen(path, "rb");
+	free(path);
+	
+	if(!f) return(-1);
+	
+	/* Check the cache is for this device and request. */
+	if(fread(&c, sizeof(c), 1, f) != 1 ||
+	   memcmp(c.magic, SRC_V4L2_CACHE_MAGIC, sizeof(c.magic)) ||
+	   c.size != sizeof(c) ||
+	   memcmp(c.driver, s->cap.driver, sizeof(c.driver)) ||
+	   memcmp(c.card, s->cap.card, sizeof(c.card)) ||
+	   memcmp(c.bus_info, s->cap.bus_info, sizeof(c.bus_info)) ||
+	   c.version != s->cap.version || c.type != s->type ||
+	   c.palette != src->palette ||
+	   c.width != src->width || c.height != src->height ||
+	   c.auto_mode != !!src->auto_mode ||
+	   c.palette_policy != src->palette_policy)
 	{
-		ERROR("Error requesting buffers for memory map.");
-		ERROR("VIDIOC_REQBUFS: %s", strerror(errno));
+		fclose(f);
 		return(-1);
 	}
 	
-	DEBUG("mmap information:");
-	DEBUG("frames=%d", s->req.count);
+	s->ctrl = calloc(c.ctrls + 1, sizeof(struct v4l2_queryctrl));
+	s->menu = calloc(c.menus + 1, sizeof(struct v4l2_querymenu));
 	
-	if(s->req.count < 2)
+	if(!s->ctrl || !s->menu ||
+	   fread(s->ctrl, sizeof(struct v4l2_queryctrl), c.ctrls, f) != c.ctrls ||
+	   fread(s->menu, sizeof(struct v4l2_querymenu), c.menus, f) != c.menus)
 	{
-		ERROR("Insufficient buffer memory.");
+		WARN("Unable to read the device cache.");
+		
+		free(s->ctrl);
+		free(s->menu);
+		s->ctrl = NULL;
+		s->menu = NULL;
+		
+		fclose(f);
 		return(-1);
-        }
+	}
 	
-	s->buffer = calloc(s->req.count, sizeof(v4l2_buffer_t));
-	if(!s->buffer)
+	fclose(f);
+	
+	s->ctrls = c.ctrls;
+	s->menus = c.menus;
+	s->controls_loaded = -1;
+	
+	s->fmt = c.fmt;
+	src->palette = c.src_palette;
+	s->cached = -1;
+	
+	DEBUG("Using cached format and controls.");
+	
+	return(0);
+}
+
+int src_v4l2_save_cache(src_t *src, int palette, uint32_t width, uint32_t height)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	src_v4l2_cache_t c;
+	char *path, *tmp;
+	FILE *f;
+	int r;
+	
+	/* The cache includes all the controls. */
+	if(!s->controls_loaded && src_v4l2_load_controls(src)) return(-1);
+	
+	memset(&c, 0, sizeof(c));
+	memcpy(c.magic, SRC_V4L2_CACHE_MAGIC, sizeof(c.magic));
+	c.size = sizeof(c);
+	memcpy(c.driver, s->cap.driver, sizeof(c.driver));
+	memcpy(c.card, s->cap.card, sizeof(c.card));
+	memcpy(c.bus_info, s->cap.bus_info, sizeof(c.bus_info));
+	c.version     = s->cap.version;
+	c.type        = s->type;
+	c.palette     = palette;
+	c.width       = width;
+	c.height      = height;
+	c.auto_mode   = !!src->auto_mode;
+	c.palette_policy = src->palette_policy;
+	c.src_palette = src->palette;
+	c.fmt         = s->fmt;
+	c.ctrls       = s->ctrls;
+	c.menus       = s->menus;
+	
+	path = src_v4l2_cache_path(src);
+	if(!path) return(-1);
+	
+	tmp = malloc(strlen(path) + 5);
+	if(!tmp)
 	{
 		ERROR("Out of memory.");
+		free(path);
 		return(-1);
 	}
 	
-	for(b = 0; b < s->req.count; b++)
+	/* Write to a temporary file so the cache is replaced in one go. */
+	sprintf(tmp, "%s.tmp", path);
+	
+	f = fopen(tmp, "wb");
+	if(!f)
 	{
-		struct v4l2_buffer buf;
-		
-		memset(&buf, 0, sizeof(buf));
-		
-		buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index  = b;
-		
-		if(ioctl(s->fd, VIDIOC_QUERYBUF, &buf) == -1)
-		{
-			ERROR("Error querying buffer %i", b);
-			ERROR("VIDIOC_QUERYBUF: %s", strerror(errno));
-			free(s->buffer);
-			s->buffer = NULL;
-			return(-1);
-		}
-		
-		s->buffer[b].length = buf.length;
-		s->buffer[b].start = mmap(NULL, buf.length,
-		   PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, buf.m.offset);
-		
-		if(s->buffer[b].start == MAP_FAILED)
-		{
-			ERROR("Error mapping buffer %i", b);
-			ERROR("mmap: %s", strerror(errno));
-			s->req.count = b;
-			src_v4l2_free_mmap(src);
-			free(s->buffer);
-			s->buffer = NULL;
-			return(-1);
-		}
-		
-		DEBUG("%i length=%d", b, buf.length);
+		WARN("Unable to write the device cache %s", path);
+		WARN("fopen: %s", strerror(errno));
+		free(tmp);
+		free(path);
+		return(-1);
 	}
 	
-	s->map = -1;
+	r = 0;
+	if(fwrite(&c, sizeof(c), 1, f) != 1) r = -1;
+	if(fwrite(s->ctrl, sizeof(struct v4l2_queryctrl), s->ctrls, f) != s->ctrls) r = -1;
+	if(fwrite(s->menu, sizeof(struct v4l2_querymenu), s->menus, f) != s->menus) r = -1;
+	if(fclose(f)) r = -1;
 	
-	for(b = 0; b < s->req.count; b++)
+	if(r || rename(tmp, path))
 	{
-		memset(&s->buf, 0, sizeof(s->buf));
-		
-		s->buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		s->buf.memory = V4L2_MEMORY_MMAP;
-		s->buf.index  = b;
-		
-		if(ioctl(s->fd, VIDIOC_QBUF, &s->buf) == -1)
-		{
-			ERROR("VIDIOC_QBUF: %s", strerror(errno));
-			src_v4l2_free_mmap(src);
-			free(s->buffer);
-			s->buffer = NULL;
-			return(-1);
+		WARN("Unable to write the device cache %s", path);
+		unlink(tmp);
+		r = -1;
+	}
+	else DEBUG("Saved format and controls to %s", path);
+	
+	free(tmp);
+	free(path);
+	
+	return(r);
+}
+
+int src_v4l2_set_cached_format(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	uint32_t pixelformat;
+	
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+		pixelformat = s->fmt.fmt.pix_mp.pixelformat;
+	else
+		pixelformat = s->fmt.fmt.pix.pixelformat;
+	
+	if(ioctl(s->fd, VIDIOC_S_FMT, &s->fmt) == -1)
+	{
+		DEBUG("VIDIOC_S_FMT: %s", strerror(errno));
+		return(-1);
+	}
+	
+	/* The driver may have picked another format after all. */
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+	{
+		if(s->fmt.fmt.pix_mp.pixelformat != pixelformat) return(-1);
+		src->width  = s->fmt.fmt.pix_mp.width;
+		src->height = s->fmt.fmt.pix_mp.height;
+	}
+	else
+	{
+		if(s->fmt.fmt.pix.pixelformat != pixelformat) return(-1);
+		src->width  = s->fmt.fmt.pix.width;
+		src->height = s->fmt.fmt.pix.height;
+	}
+	
+	INFO("Using palette %s", src_palette[src->palette].name);
+	
+	src_v4l2_format_set(src, pixelformat);
+	
+	return(0);
+}
+
+int src_v4l2_set_fps(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_streamparm setfps;
+	
+	memset(&setfps, 0, sizeof(setfps));
+	
+	setfps.type = s->type;
+	setfps.parm.capture.timeperframe.numerator = 1;
+	setfps.parm.capture.timeperframe.denominator = src->fps;
+	if(ioctl(s->fd, VIDIOC_S_PARM, &setfps) == -1)
+	{
+		/* Not fatal - just warn about it */
+		WARN("Error setting frame rate:");
+		WARN("VIDIOC_S_PARM: %s", strerror(errno));
+		return(-1);
+	}
+	
+	return(0);
+}
+
+int src_v4l2_pick_size(src_t *src, uint32_t pixelformat,
+                       uint32_t *width, uint32_t *height)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_frmsizeenum fs;
+	uint32_t w, h, best_w, best_h, max_w, max_h;
+	
+	best_w = best_h = max_w = max_h = 0;
+	
+	memset(&fs, 0, sizeof(fs));
+	fs.pixel_format = pixelformat;
+	
+	while(!ioctl(s->fd, VIDIOC_ENUM_FRAMESIZES, &fs))
+	{
+		/* Any size in the range will do. Leave it to the driver. */
+		if(fs.type != V4L2_FRMSIZE_TYPE_DISCRETE) return(0);
+		
+		w = fs.discrete.width;
+		h = fs.discrete.height;
+		
+		/* Look for the smallest size the image fits in... */
+		if(w >= *width && h >= *height &&
+		   (!best_w || (uint64_t) w * h < (uint64_t) best_w * best_h))
+		{
+			best_w = w;
+			best_h = h;
+		}
+		
+		/* ...or the largest if it fits in none of them. */
+		if((uint64_t) w * h > (uint64_t) max_w * max_h)
+		{
+			max_w = w;
+			max_h = h;
+		}
+		
+		fs.index++;
+	}
+	
+	if(!best_w)
+	{
+		best_w = max_w;
+		best_h = max_h;
+	}
+	
+	if(!best_w) return(-1);
+	
+	if(best_w != *width || best_h != *height)
+		DEBUG("Picked frame size %ix%i for %ix%i.",
+		      best_w, best_h, *width, *height);
+	
+	*width  = best_w;
+	*height = best_h;
+	
+	return(0);
+}
+
+/* Returns < 0 if interval a is shorter (faster) than b. */
+static int src_v4l2_cmp_interval(struct v4l2_fract *a, struct v4l2_fract *b)
+{
+	uint64_t x = (uint64_t) a->numerator * b->denominator;
+	uint64_t y = (uint64_t) b->numerator * a->denominator;
+	
+	return(x < y ? -1 : x > y);
+}
+
+int src_v4l2_pick_interval(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_frmivalenum fi;
+	struct v4l2_streamparm parm;
+	struct v4l2_fract want, best, fit, fast;
+	
+	/* Find the slowest interval that is at least the requested
+	 * frame rate, or the fastest if there is none or no rate was
+	 * given. */
+	want.numerator   = src->fps ? 1 : 0;
+	want.denominator = src->fps ? src->fps : 1;
+	
+	memset(&best, 0, sizeof(best));
+	memset(&fit,  0, sizeof(fit));
+	memset(&fast, 0, sizeof(fast));
+	
+	memset(&fi, 0, sizeof(fi));
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+		fi.pixel_format = s->fmt.fmt.pix_mp.pixelformat;
+	else
+		fi.pixel_format = s->fmt.fmt.pix.pixelformat;
+	fi.width  = src->width;
+	fi.height = src->height;
+	
+	while(!ioctl(s->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi))
+	{
+		if(fi.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+		{
+			/* The requested rate if it's in the range. */
+			fast = fi.stepwise.min;
+			if(src_v4l2_cmp_interval(&want, &fast) > 0) fast = want;
+			if(src_v4l2_cmp_interval(&fast, &fi.stepwise.max) > 0)
+				fast = fi.stepwise.max;
+			break;
+		}
+		
+		if(!fast.denominator ||
+		   src_v4l2_cmp_interval(&fi.discrete, &fast) < 0)
+			fast = fi.discrete;
+		
+		if(src->fps &&
+		   src_v4l2_cmp_interval(&fi.discrete, &want) <= 0 &&
+		   (!fit.denominator ||
+		    src_v4l2_cmp_interval(&fi.discrete, &fit) > 0))
+			fit = fi.discrete;
+		
+		fi.index++;
+	}
+	
+	best = fit.denominator ? fit : fast;
+	
+	if(!best.denominator || !best.numerator)
+	{
+		/* The device doesn't list its frame rates. */
+		if(src->fps) return(src_v4l2_set_fps(src));
+		return(0);
+	}
+	
+	memset(&parm, 0, sizeof(parm));
+	parm.type = s->type;
+	parm.parm.capture.timeperframe = best;
+	
+	if(ioctl(s->fd, VIDIOC_S_PARM, &parm) == -1)
+	{
+		WARN("Error setting frame rate:");
+		WARN("VIDIOC_S_PARM: %s", strerror(errno));
+		return(-1);
+	}
+	
+	best = parm.parm.capture.timeperframe;
+	if(!best.numerator) best.numerator = 1;
+	
+	MSG("Using mode %ix%i at %.2f fps.", src->width, src->height,
+	    (double) best.denominator / best.numerator);
+	
+	return(0);
+}
+
+int src_v4l2_list_modes(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_frmsizeenum fs;
+	struct v4l2_frmivalenum fi;
+	uint32_t pixelformat;
+	
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+		pixelformat = s->fmt.fmt.pix_mp.pixelformat;
+	else
+		pixelformat = s->fmt.fmt.pix.pixelformat;
+	
+	if(src->list & SRC_LIST_FRAMESIZES)
+	{
+		HEAD("--- Frame sizes for %s:", src_palette[src->palette].name);
+		
+		memset(&fs, 0, sizeof(fs));
+		fs.pixel_format = pixelformat;
+		
+		while(!ioctl(s->fd, VIDIOC_ENUM_FRAMESIZES, &fs))
+		{
+			if(fs.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+				MSG("%ix%i", fs.discrete.width, fs.discrete.height);
+			else
+			{
+				MSG("%ix%i to %ix%i, in steps of %ix%i",
+				    fs.stepwise.min_width, fs.stepwise.min_height,
+				    fs.stepwise.max_width, fs.stepwise.max_height,
+				    fs.stepwise.step_width, fs.stepwise.step_height);
+				break;
+			}
+			
+			fs.index++;
+		}
+	}
+	
+	if(src->list & SRC_LIST_FRAMERATES)
+	{
+		HEAD("--- Frame rates at %ix%i:", src->width, src->height);
+		
+		memset(&fi, 0, sizeof(fi));
+		fi.pixel_format = pixelformat;
+		fi.width        = src->width;
+		fi.height       = src->height;
+		
+		while(!ioctl(s->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi))
+		{
+			if(fi.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+				MSG("%.2f fps", (double) fi.discrete.denominator /
+				    fi.discrete.numerator);
+			else
+			{
+				MSG("%.2f to %.2f fps",
+				    (double) fi.stepwise.max.denominator /
+				    fi.stepwise.max.numerator,
+				    (double) fi.stepwise.min.denominator /
+				    fi.stepwise.min.numerator);
+				break;
+			}
+			
+			fi.index++;
+		}
+	}
+	
+	return(0);
+}
+
+int src_v4l2_try_palette(src_t *src, int v4l2_pal,
+                         uint32_t *width, uint32_t *height)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	uint32_t pixelformat;
+	
+	/* Use the best of the device's own frame sizes. */
+	*width  = src->width;
+	*height = src->height;
+	
+	if(src->auto_mode)
+		src_v4l2_pick_size(src, v4l2_palette[v4l2_pal].v4l2,
+		                   width, height);
+	
+	memset(&s->fmt, 0, sizeof(s->fmt));
+	s->fmt.type = s->type;
+	
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+	{
+		s->fmt.fmt.pix_mp.width       = *width;
+		s->fmt.fmt.pix_mp.height      = *height;
+		s->fmt.fmt.pix_mp.pixelformat = v4l2_palette[v4l2_pal].v4l2;
+		s->fmt.fmt.pix_mp.field       = V4L2_FIELD_ANY;
+	}
+	else
+	{
+		s->fmt.fmt.pix.width       = *width;
+		s->fmt.fmt.pix.height      = *height;
+		s->fmt.fmt.pix.pixelformat = v4l2_palette[v4l2_pal].v4l2;
+		s->fmt.fmt.pix.field       = V4L2_FIELD_ANY;
+	}
+	
+	if(ioctl(s->fd, VIDIOC_TRY_FMT, &s->fmt) == -1) return(-1);
+	
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+	{
+		*width      = s->fmt.fmt.pix_mp.width;
+		*height     = s->fmt.fmt.pix_mp.height;
+		pixelformat = s->fmt.fmt.pix_mp.pixelformat;
+	}
+	else
+	{
+		*width      = s->fmt.fmt.pix.width;
+		*height     = s->fmt.fmt.pix.height;
+		pixelformat = s->fmt.fmt.pix.pixelformat;
+	}
+	
+	/* The device may have offered another format instead. */
+	if(pixelformat != v4l2_palette[v4l2_pal].v4l2) return(-1);
+	
+	return(0);
+}
+
+int src_v4l2_rank_palettes(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_frmivalenum fi;
+	src_palette_t *p;
+	uint32_t width, height;
+	double pixels, cost, tie, best_cost, best_tie, interval;
+	int v4l2_pal, best;
+	
+	best = -1;
+	best_cost = best_tie = 0;
+	
+	for(v4l2_pal = 0; v4l2_palette[v4l2_pal].v4l2; v4l2_pal++)
+	{
+		if(src_v4l2_try_palette(src, v4l2_pal, &width, &height)) continue;
+		
+		p = &src_palette[v4l2_palette[v4l2_pal].src];
+		pixels = (double) width * height;
+		
+		/* The fastest the device can send frames this size, if known. */
+		memset(&fi, 0, sizeof(fi));
+		fi.pixel_format = v4l2_palette[v4l2_pal].v4l2;
+		fi.width        = width;
+		fi.height       = height;
+		
+		interval = 0;
+		if(!ioctl(s->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi))
+		{
+			struct v4l2_fract *f = &fi.discrete;
+			
+			if(fi.type != V4L2_FRMIVAL_TYPE_DISCRETE) f = &fi.stepwise.min;
+			
+			/* Discrete intervals aren't in any order. */
+			do
+			{
+				if(f->denominator)
+				{
+					double i = 1e9 * f->numerator / f->denominator;
+					if(!interval || i < interval) interval = i;
+				}
+				
+				fi.index++;
+			}
+			while(fi.type == V4L2_FRMIVAL_TYPE_DISCRETE &&
+			      !ioctl(s->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi));
+		}
+		
+		switch(src->palette_policy)
+		{
+		case SRC_POLICY_FASTEST:
+			/* The time for each frame is the slower of
+			 * the decoding and the device. */
+			cost = p->decode * pixels;
+			if(interval > cost) cost = interval;
+			tie  = p->bytes * pixels;
+			break;
+		case SRC_POLICY_SMALLEST:
+			cost = p->bytes * pixels;
+			tie  = p->decode * pixels;
+			break;
+		default: /* SRC_POLICY_QUALITY */
+			cost = -p->quality;
+			tie  = p->decode * pixels;
+			break;
+		}
+		
+		DEBUG("%s at %ix%i: cost %.0f, %.0f",
+		      p->name, width, height, cost, tie);
+		
+		if(best == -1 || cost < best_cost ||
+		   (cost == best_cost && tie < best_tie))
+		{
+			best = v4l2_pal;
+			best_cost = cost;
+			best_tie  = tie;
+		}
+	}
+	
+	if(best != -1)
+		DEBUG("Palette policy picked %s.",
+		      src_palette[v4l2_palette[best].src].name);
+	
+	return(best);
+}
+
+int src_v4l2_set_pix_format(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_fmtdesc fmt;
+	int v4l2_pal, best;
+	
+	/* Dump a list of formats the device supports. */
+	DEBUG("Device offers the following V4L2 pixel formats:");
+	
+	v4l2_pal = 0;
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.index = v4l2_pal;
+	fmt.type  = s->type;
+	
+	while(ioctl(s->fd, VIDIOC_ENUM_FMT, &fmt) != -1)
+	{
+		DEBUG("%i: [0x%08X] '%c%c%c%c' (%s)", v4l2_pal,
+		      fmt.pixelformat,
+		      fmt.pixelformat >> 0,  fmt.pixelformat >> 8,
+		      fmt.pixelformat >> 16, fmt.pixelformat >> 24,
+		      fmt.description);
+		
+		memset(&fmt, 0, sizeof(fmt));
+		fmt.index = ++v4l2_pal;
+		fmt.type  = s->type;
+	}
+	
+	/* Check the requested palette can be handled. */
+	if(src->palette != SRC_PAL_ANY)
+	{
+		for(v4l2_pal = 0; v4l2_palette[v4l2_pal].v4l2; v4l2_pal++)
+			if(v4l2_palette[v4l2_pal].src == src->palette) break;
+		
+		if(!v4l2_palette[v4l2_pal].v4l2)
+		{
+			ERROR("Unable to handle palette format %s.",
+			      src_palette[src->palette].name);
+			
+			return(-1);
+		}
+	}
+	
+	/* Rank the palettes if a policy was given. */
+	best = -1;
+	if(src->palette == SRC_PAL_ANY && src->palette_policy)
+		best = src_v4l2_rank_palettes(src);
+	
+	/* Step through each palette type. */
+	for(v4l2_pal = 0; v4l2_palette[v4l2_pal].v4l2; v4l2_pal++)
+	{
+		uint32_t width, height, pixelformat;
+		
+		if(best != -1 && v4l2_pal != best) continue;
+		
+		if(src->palette != SRC_PAL_ANY &&
+		   src->palette != v4l2_palette[v4l2_pal].src) continue;
+		
+		/* Try the palette... */
+		if(src_v4l2_try_palette(src, v4l2_pal, &width, &height)) continue;
+		
+		pixelformat = v4l2_palette[v4l2_pal].v4l2;
+		src->palette = v4l2_palette[v4l2_pal].src;
+		
+		INFO("Using palette %s", src_palette[src->palette].name);
+		
+		if(width != src->width || height != src->height)
+		{
+			MSG("Adjusting resolution from %ix%i to %ix%i.",
+			    src->width, src->height, width, height);
+			src->width = width;
+			src->height = height;
+		}
+		
+		if(ioctl(s->fd, VIDIOC_S_FMT, &s->fmt) == -1)
+		{
+			ERROR("Error setting pixel format.");
+			ERROR("VIDIOC_S_FMT: %s", strerror(errno));
+			return(-1);
+		}
+		
+		src_v4l2_format_set(src, pixelformat);
+		
+		return(0);
+	}
+	
+	ERROR("Unable to find a compatible palette format.");
+	
+	return(-1);
+}
+
+int src_v4l2_set_selection(src_t *src, uint32_t target, struct v4l2_rect *r)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_selection sel;
+	
+	/* The selection API doesn't take the multi-planar types. */
+	memset(&sel, 0, sizeof(sel));
+	sel.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	sel.target = target;
+	sel.r      = *r;
+	
+	if(ioctl(s->fd, VIDIOC_S_SELECTION, &sel) == -1)
+	{
+		DEBUG("VIDIOC_S_SELECTION: %s", strerror(errno));
+		return(-1);
+	}
+	
+	/* The device may have adjusted the area. */
+	if(sel.r.left != r->left || sel.r.top != r->top ||
+	   sel.r.width != r->width || sel.r.height != r->height)
+	{
+		DEBUG("Device adjusted the crop area to %ix%i [offset: %ix%i].",
+		      sel.r.width, sel.r.height, sel.r.left, sel.r.top);
+		*r = sel.r;
+		return(-1);
+	}
+	
+	return(0);
+}
+
+int src_v4l2_reset_crop(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	
+	if(!s->crop_set) return(0);
+	
+	s->crop_set = 0;
+	
+	return(src_v4l2_set_selection(src, V4L2_SEL_TGT_CROP, &s->crop_orig));
+}
+
+int src_v4l2_set_crop(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_selection sel;
+	struct v4l2_format fmt;
+	struct v4l2_rect r;
+	uint32_t w, h, pixelformat;
+	int32_t x, y;
+	
+	w = src->crop_width;
+	h = src->crop_height;
+	
+	if(w > src->width || h > src->height) return(-1);
+	
+	/* By default crop the center of the image. */
+	x = src->crop_x;
+	y = src->crop_y;
+	
+	if(x < 0 || y < 0)
+	{
+		x = (src->width  - w) / 2;
+		y = (src->height - h) / 2;
+	}
+	
+	if(x + w > src->width || y + h > src->height) return(-1);
+	
+	/* Find the part of the sensor currently being captured. */
+	memset(&sel, 0, sizeof(sel));
+	sel.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	sel.target = V4L2_SEL_TGT_CROP;
+	
+	if(ioctl(s->fd, VIDIOC_G_SELECTION, &sel) == -1)
+	{
+		DEBUG("VIDIOC_G_SELECTION: %s", strerror(errno));
+		return(-1);
+	}
+	
+	s->crop_orig = sel.r;
+	s->crop_set  = -1;
+	
+	/* Scale the area from the image to the sensor. */
+	r.left   = sel.r.left + (int64_t) x * sel.r.width  / src->width;
+	r.top    = sel.r.top  + (int64_t) y * sel.r.height / src->height;
+	r.width  = (uint64_t) w * sel.r.width  / src->width;
+	r.height = (uint64_t) h * sel.r.height / src->height;
+	
+	if(src_v4l2_set_selection(src, V4L2_SEL_TGT_CROP, &r))
+	{
+		src_v4l2_reset_crop(src);
+		return(-1);
+	}
+	
+	/* Ask for an image the size of the cropped area. */
+	fmt = s->fmt;
+	
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+	{
+		fmt.fmt.pix_mp.width  = w;
+		fmt.fmt.pix_mp.height = h;
+		pixelformat = fmt.fmt.pix_mp.pixelformat;
+	}
+	else
+	{
+		fmt.fmt.pix.width  = w;
+		fmt.fmt.pix.height = h;
+		pixelformat = fmt.fmt.pix.pixelformat;
+	}
+	
+	if(ioctl(s->fd, VIDIOC_S_FMT, &fmt) == -1)
+	{
+		DEBUG("VIDIOC_S_FMT: %s", strerror(errno));
+		src_v4l2_reset_crop(src);
+		return(-1);
+	}
+	
+	if((V4L2_TYPE_IS_MULTIPLANAR(s->type) &&
+	    (fmt.fmt.pix_mp.width != w || fmt.fmt.pix_mp.height != h ||
+	     fmt.fmt.pix_mp.pixelformat != pixelformat)) ||
+	   (!V4L2_TYPE_IS_MULTIPLANAR(s->type) &&
+	    (fmt.fmt.pix.width != w || fmt.fmt.pix.height != h ||
+	     fmt.fmt.pix.pixelformat != pixelformat)))
+	{
+		/* Put the crop area and format back as they were. */
+		DEBUG("Device can't capture the cropped area at %ix%i.", w, h);
+		src_v4l2_reset_crop(src);
+		ioctl(s->fd, VIDIOC_S_FMT, &s->fmt);
+		return(-1);
+	}
+	
+	MSG("Cropping image from %ix%i [offset: %ix%i] -> %ix%i on the device.",
+	    src->width, src->height, x, y, w, h);
+	
+	s->fmt = fmt;
+	src->width  = w;
+	src->height = h;
+	src_v4l2_format_set(src, pixelformat);
+	
+	return(0);
+}
+
+int src_v4l2_free_mmap(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	int i;
+	
+	for(i = 0; i < s->req.count * s->planes; i++)
+	{
+		munmap(s->buffer[i].start, s->buffer[i].length);
+		if(s->buffer[i].dmabuf >= 0) close(s->buffer[i].dmabuf);
+	}
+	
+	return(0);
+}
+
+int src_v4l2_export_mmap(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_exportbuffer expbuf;
+	uint32_t b;
+	
+	/* Only one descriptor is passed on for each frame. */
+	if(s->planes > 1)
+	{
+		WARN("Unable to export multi-planar buffers.");
+		return(-1);
+	}
+	
+	for(b = 0; b < s->req.count; b++)
+	{
+		memset(&expbuf, 0, sizeof(expbuf));
+		
+		expbuf.type  = s->type;
+		expbuf.index = b;
+		expbuf.flags = O_RDONLY | O_CLOEXEC;
+		
+		if(ioctl(s->fd, VIDIOC_EXPBUF, &expbuf) == -1)
+		{
+			/* Not fatal, the frames just won't be exported. */
+			WARN("Unable to export buffer %i.", b);
+			WARN("VIDIOC_EXPBUF: %s", strerror(errno));
+			return(-1);
+		}
+		
+		s->buffer[b].dmabuf = expbuf.fd;
+		
+		DEBUG("%i dmabuf=%d", b, expbuf.fd);
+	}
+	
+	return(0);
+}
+
+void src_v4l2_init_buf(src_t *src, struct v4l2_buffer *buf,
+                       struct v4l2_plane *planes)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	
+	memset(buf, 0, sizeof(struct v4l2_buffer));
+	
+	buf->type   = s->type;
+	buf->memory = s->memory;
+	
+	/* Multi-planar buffers describe each plane separately. */
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+	{
+		memset(planes, 0, sizeof(struct v4l2_plane) * VIDEO_MAX_PLANES);
+		buf->m.planes = planes;
+		buf->length   = VIDEO_MAX_PLANES;
+	}
+}
+
+int src_v4l2_set_mmap(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	enum v4l2_buf_type type;
+	uint32_t b, p;
+	
+	/* Does the device support streaming? */
+	if(~s->cap.capabilities & V4L2_CAP_STREAMING) return(-1);
+	
+	memset(&s->req, 0, sizeof(s->req));
+	
+	s->req.count  = (src->buffers ? src->buffers : 4);
+	s->req.type   = s->type;
+	s->req.memory = V4L2_MEMORY_MMAP;
+	
+	if(ioctl(s->fd, VIDIOC_REQBUFS, &s->req) == -1)
+	{
+		ERROR("Error requesting buffers for memory map.");
+		ERROR("VIDIOC_REQBUFS: %s", strerror(errno));
+		return(-1);
+	}
+	
+	DEBUG("mmap information:");
+	DEBUG("frames=%d", s->req.count);
+	
+	if(s->req.count < 2)
+	{
+		ERROR("Insufficient buffer memory.");
+		return(-1);
+        }
+	
+	s->buffer = calloc(s->req.count * s->planes, sizeof(v4l2_buffer_t));
+	if(!s->buffer)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	s->memory = V4L2_MEMORY_MMAP;
+	
+	for(b = 0; b < s->req.count; b++)
+	{
+		struct v4l2_buffer buf;
+		struct v4l2_plane planes[VIDEO_MAX_PLANES];
+		
+		src_v4l2_init_buf(src, &buf, planes);
+		buf.index = b;
+		
+		if(ioctl(s->fd, VIDIOC_QUERYBUF, &buf) == -1)
+		{
+			ERROR("Error querying buffer %i", b);
+			ERROR("VIDIOC_QUERYBUF: %s", strerror(errno));
+			s->req.count = b;
+			src_v4l2_free_mmap(src);
+			free(s->buffer);
+			s->buffer = NULL;
+			return(-1);
+		}
+		
+		for(p = 0; p < s->planes; p++)
+		{
+			v4l2_buffer_t *pb = &s->buffer[b * s->planes + p];
+			uint32_t offset;
+			
+			if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+			{
+				pb->length = planes[p].length;
+				offset     = planes[p].m.mem_offset;
+			}
+			else
+			{
+				pb->length = buf.length;
+				offset     = buf.m.offset;
+			}
+			
+			pb->dmabuf = -1;
+			pb->start  = mmap(NULL, pb->length,
+			   PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, offset);
+			
+			if(pb->start == MAP_FAILED)
+			{
+				ERROR("Error mapping buffer %i", b);
+				ERROR("mmap: %s", strerror(errno));
+				
+				/* Unmap any planes of this buffer already mapped. */
+				while(p--)
+				{
+					pb--;
+					munmap(pb->start, pb->length);
+				}
+				
+				s->req.count = b;
+				src_v4l2_free_mmap(src);
+				free(s->buffer);
+				s->buffer = NULL;
+				return(-1);
+			}
+			
+			DEBUG("%i.%i length=%d", b, p, pb->length);
+		}
+	}
+	
+	/* Export the buffers so they can be passed to other processes. */
+	if(src->dmabuf) src_v4l2_export_mmap(src);
+	
+	s->map = -1;
+	
+	for(b = 0; b < s->req.count; b++)
+	{
+		src_v4l2_init_buf(src, &s->buf, s->plane);
+		s->buf.index = b;
+		
+		if(ioctl(s->fd, VIDIOC_QBUF, &s->buf) == -1)
+		{
+			ERROR("VIDIOC_QBUF: %s", strerror(errno));
+			src_v4l2_free_mmap(src);
+			free(s->buffer);
+			s->buffer = NULL;
+			return(-1);
+		}
+	}
+	
+	type = s->type;
+	
+	if(ioctl(s->fd, VIDIOC_STREAMON, &type) == -1)
+	{
+		ERROR("Error starting stream.");
+		ERROR("VIDIOC_STREAMON: %s", strerror(errno));
+		src_v4l2_free_mmap(src);
+		free(s->buffer);
+		s->buffer = NULL;
+		return(-1);
+	}
+	
+	return(0);
+}
+
+int src_v4l2_free_userptr(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	enum v4l2_buf_type type;
+	int i;
+	
+	/* Stop the device writing to the buffers before releasing them. */
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ioctl(s->fd, VIDIOC_STREAMOFF, &type);
+	
+	for(i = 0; i < s->req.count; i++)
+	{
+		/* A detached buffer now belongs to someone else. */
+		if(i == s->pframe && src->detached) continue;
+		src_pool_free(s->buffer[i].start, s->buffer[i].length);
+	}
+	
+	return(0);
+}
+
+int src_v4l2_set_userptr(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	enum v4l2_buf_type type;
+	uint32_t b;
+	
+	/* Does the device support streaming? */
+	if(~s->cap.capabilities & V4L2_CAP_STREAMING) return(-1);
+	
+	/* Only single-planar formats are supported. */
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type)) return(-1);
+	
+	memset(&s->req, 0, sizeof(s->req));
+	
+	s->req.count  = (src->buffers ? src->buffers : 4);
+	s->req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	s->req.memory = V4L2_MEMORY_USERPTR;
+	
+	if(ioctl(s->fd, VIDIOC_REQBUFS, &s->req) == -1)
+	{
+		ERROR("Error requesting user pointer buffers.");
+		ERROR("VIDIOC_REQBUFS: %s", strerror(errno));
+		return(-1);
+	}
+	
+	DEBUG("userptr information:");
+	DEBUG("frames=%d", s->req.count);
+	
+	if(s->req.count < 2)
+	{
+		ERROR("Insufficient buffer memory.");
+		return(-1);
+	}
+	
+	s->buffer = calloc(s->req.count, sizeof(v4l2_buffer_t));
+	if(!s->buffer)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	for(b = 0; b < s->req.count; b++)
+	{
+		s->buffer[b].length = s->fmt.fmt.pix.sizeimage;
+		s->buffer[b].start  = src_pool_alloc(s->buffer[b].length);
+		
+		if(!s->buffer[b].start)
+		{
+			ERROR("Out of memory.");
+			s->req.count = b;
+			src_v4l2_free_userptr(src);
+			free(s->buffer);
+			s->buffer = NULL;
+			return(-1);
+		}
+		
+		DEBUG("%i length=%d", b, s->buffer[b].length);
+	}
+	
+	s->map = -1;
+	s->memory = V4L2_MEMORY_USERPTR;
+	
+	for(b = 0; b < s->req.count; b++)
+	{
+		memset(&s->buf, 0, sizeof(s->buf));
+		
+		s->buf.type      = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		s->buf.memory    = V4L2_MEMORY_USERPTR;
+		s->buf.index     = b;
+		s->buf.m.userptr = (unsigned long) s->buffer[b].start;
+		s->buf.length    = s->buffer[b].length;
+		
+		if(ioctl(s->fd, VIDIOC_QBUF, &s->buf) == -1)
+		{
+			ERROR("VIDIOC_QBUF: %s", strerror(errno));
+			src_v4l2_free_userptr(src);
+			free(s->buffer);
+			s->buffer = NULL;
+			s->map = 0;
+			return(-1);
+		}
+	}
+	
+	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	
+	if(ioctl(s->fd, VIDIOC_STREAMON, &type) == -1)
+	{
+		ERROR("Error starting stream.");
+		ERROR("VIDIOC_STREAMON: %s", strerror(errno));
+		src_v4l2_free_userptr(src);
+		free(s->buffer);
+		s->buffer = NULL;
+		s->map = 0;
+		return(-1);
+	}
+	
+	src->pooled = -1;
+	
+	return(0);
+}
+
+int src_v4l2_set_read(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	
+	if(~s->cap.capabilities & V4L2_CAP_READWRITE) return(-1);
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type)) return(-1);
+	
+	s->buffer = calloc(1, sizeof(v4l2_buffer_t));
+	if(!s->buffer)
+	{
+		ERROR("Out of memory.");
+		return(-1);
+	}
+	
+	s->buffer[0].length = s->fmt.fmt.pix.sizeimage;
+	s->buffer[0].start  = malloc(s->buffer[0].length);
+	
+	if(!s->buffer[0].start)
+	{
+		ERROR("Out of memory.");
+		
+		free(s->buffer);
+		s->buffer = NULL;
+		
+		return(-1);
+	}
+	
+	return(0);
+}
+
+int src_v4l2_subscribe(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_event_subscription sub;
+	uint32_t type[] = { V4L2_EVENT_SOURCE_CHANGE, V4L2_EVENT_EOS };
+	int i;
+	
+	s->events = 0;
+	
+	for(i = 0; i < 2; i++)
+	{
+		memset(&sub, 0, sizeof(sub));
+		sub.type = type[i];
+		
+		if(ioctl(s->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1)
+		{
+			DEBUG("VIDIOC_SUBSCRIBE_EVENT: %s", strerror(errno));
+			continue;
+		}
+		
+		s->events = -1;
+	}
+	
+	return(0);
+}
+
+static int src_v4l2_open(src_t *src)
+{
+	src_v4l2_t *s;
+	uint32_t width, height;
+	int palette;
+	
+	if(!src->source)
+	{
+		ERROR("No device name specified.");
+		return(-2);
+	}
+	
+	/* Allocate memory for the state structure. */
+	s = calloc(sizeof(src_v4l2_t), 1);
+	if(!s)
+	{
+		ERROR("Out of memory.");
+		return(-2);
+	}
+	
+	src->state = (void *) s;
+	
+	/* Open the device. */
+	s->fd = open(src->source, O_RDWR | O_NONBLOCK);
+	if(s->fd < 0)
+	{
+		ERROR("Error opening device: %s", src->source);
+		ERROR("open: %s", strerror(errno));
+		free(s);
+		return(-2);
+	}
+	
+	MSG("%s opened.", src->source);
+	
+	/* Get the device capabilities. */
+	if(src_v4l2_get_capability(src))
+	{
+		src_v4l2_close(src);
+		return(-2);
+	}
+	
+	/* Set the input. */
+	if(src_v4l2_set_input(src))
+	{
+		src_v4l2_close(src);
+		return(-1);
+	}
+	
+	/* Skip the format and control enumeration if it's cached. */
+	palette = src->palette;
+	width   = src->width;
+	height  = src->height;
+	
+	if(src->cache) src_v4l2_load_cache(src);
+	
+	/* Set picture options. */
+	src_v4l2_set_controls(src);
+	
+	/* Use the cached pixel format if possible. */
+	if(s->cached && src_v4l2_set_cached_format(src))
+	{
+		MSG("Cached format was rejected. Negotiating again.");
+		
+		s->cached    = 0;
+		src->palette = palette;
+		src->width   = width;
+		src->height  = height;
+	}
+	
+	/* Set the pixel format. */
+	if(!s->cached)
+	{
+		if(src_v4l2_set_pix_format(src))
+		{
+			src_v4l2_close(src);
+			return(-1);
+		}
+		
+		if(src->cache) src_v4l2_save_cache(src, palette, width, height);
+	}
+	
+	/* Have the device crop the image if requested. */
+	src->cropped = 0;
+	if(src->crop_width && src->crop_height)
+	{
+		if(!src_v4l2_set_crop(src)) src->cropped = -1;
+		else MSG("Device is unable to crop the image.");
+	}
+	
+	/* Pick the frame rate from those the device offers,
+	 * or set it if > 0 */
+	if(src->auto_mode) src_v4l2_pick_interval(src);
+	else if(src->fps) src_v4l2_set_fps(src);
+	
+	if(src->list & (SRC_LIST_FRAMESIZES | SRC_LIST_FRAMERATES))
+		src_v4l2_list_modes(src);
+	
+	/* Delay to let the image settle down. */
+	if(src->delay)
+	{
+		MSG("Delaying %i seconds.", src->delay);
+		usleep(src->delay * 1000 * 1000);
+	}
+	
+	s->pframe = -1;
+	
+	/* Try to setup user pointer buffers if requested. */
+	if(!src->use_read && src->use_userptr && src_v4l2_set_userptr(src))
+	{
+		WARN("Unable to use userptr. Using mmap instead.");
+		src->use_userptr = 0;
+	}
+	
+	/* Try to setup mmap. */
+	if(!src->use_read && !s->map && src_v4l2_set_mmap(src))
+	{
+		WARN("Unable to use mmap. Using read instead.");
+		src->use_read = -1;
+	}
+	
+	/* If unable to use mmap or user requested read(). */
+	if(src->use_read)
+	{
+		if(src_v4l2_set_read(src))
+		{
+			ERROR("Unable to use read.");
+			src_v4l2_close(src);
+			return(-1);
+		}
+	}
+	
+	src_v4l2_subscribe(src);
+	
+	s->pframe = -1;
+	
+	return(0);
+}
+
+static int src_v4l2_close(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	
+	/* Nothing is open if the device couldn't be recovered. */
+	if(!s) return(0);
+	
+	if(s->buffer)
+	{
+		if(!s->map) free(s->buffer[0].start);
+		else if(s->memory == V4L2_MEMORY_USERPTR) src_v4l2_free_userptr(src);
+		else src_v4l2_free_mmap(src);
+		free(s->buffer);
+	}
+	
+	/* Leave the device capturing the same area as before. */
+	if(s->crop_set)
+	{
+		enum v4l2_buf_type type = s->type;
+		
+		/* The buffers must be released first. */
+		ioctl(s->fd, VIDIOC_STREAMOFF, &type);
+		
+		memset(&s->req, 0, sizeof(s->req));
+		s->req.type   = s->type;
+		s->req.memory = s->memory;
+		ioctl(s->fd, VIDIOC_REQBUFS, &s->req);
+		
+		src_v4l2_reset_crop(src);
+	}
+	
+	if(s->fd >= 0) close(s->fd);
+	free(s->ctrl);
+	free(s->menu);
+	free(s);
+	
+	return(0);
+}
+
+int src_v4l2_check_events(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_event ev;
+	int r = 0;
+	
+	/* Returns 1 if the stream must be restarted. */
+	memset(&ev, 0, sizeof(ev));
+	while(ioctl(s->fd, VIDIOC_DQEVENT, &ev) == 0)
+	{
+		if(ev.type == V4L2_EVENT_SOURCE_CHANGE &&
+		   ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION)
+		{
+			MSG("The source resolution has changed.");
+			r = 1;
+		}
+		else if(ev.type == V4L2_EVENT_EOS)
+		{
+			MSG("The device has ended the stream.");
+			r = 1;
+		}
+		
+		memset(&ev, 0, sizeof(ev));
+	}
+	
+	return(r);
+}
+
+/* Errors that mean the device has gone or must be restarted. */
+#define V4L2_LOST(e) ((e) == ENODEV || (e) == ENXIO || (e) == EIO)
+
+int src_v4l2_wait(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct pollfd pfd;
+	int r;
+	
+	/* Is a frame ready? With no timeout, block until it is. Returns
+	 * 1 if the device was lost or the stream needs restarting. */
+	pfd.fd     = s->fd;
+	pfd.events = POLLIN | (s->events ? POLLPRI : 0);
+	
+	while(1)
+	{
+		do r = poll(&pfd, 1, src->timeout ? (int) src->timeout : -1);
+		while(r == -1 && errno == EINTR);
+		
+		if(r == -1)
+		{
+			ERROR("poll: %s", strerror(errno));
+			return(-1);
+		}
+		
+		if(!r)
+		{
+			ERROR("Timed out waiting for frame!");
+			return(-1);
+		}
+		
+		if(pfd.revents & (POLLERR | POLLHUP))
+		{
+			ERROR("Error waiting for frame from %s.", src->source);
+			return(1);
 		}
+		
+		if(pfd.revents & POLLPRI && src_v4l2_check_events(src))
+			return(1);
+		
+		if(pfd.revents & POLLIN) break;
 	}
 	
-	type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	return(0);
+}
+
+int src_v4l2_drain(src_t *src)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	int count = 0;
 	
-	if(ioctl(s->fd, VIDIOC_STREAMON, &type) == -1)
+	/* Return any frames already waiting to the queue. */
+	while(1)
 	{
-		ERROR("Error starting stream.");
-		ERROR("VIDIOC_STREAMON: %s", strerror(errno));
-		src_v4l2_free_mmap(src);
-		free(s->buffer);
-		s->buffer = NULL;
-		return(-1);
+		src_v4l2_init_buf(src, &buf, planes);
+		
+		if(ioctl(s->fd, VIDIOC_DQBUF, &buf) == -1)
+		{
+			if(errno == EAGAIN) break;
+			
+			ERROR("VIDIOC_DQBUF: %s", strerror(errno));
+			return(-1);
+		}
+		
+		if(ioctl(s->fd, VIDIOC_QBUF, &buf) == -1)
+		{
+			ERROR("VIDIOC_QBUF: %s", strerror(errno));
+			return(-1);
+		}
+		
+		count++;
 	}
 	
-	return(0);
+	if(count) DEBUG("Discarded %i stale frames.", count);
+	
+	return(count);
 }
 
-int src_v4l2_set_read(src_t *src)
+int src_v4l2_slowest_interval(src_t *src, struct v4l2_fract *slow)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_frmivalenum fi;
 	
-	if(~s->cap.capabilities & V4L2_CAP_READWRITE) return(-1);
-	
-	s->buffer = calloc(1, sizeof(v4l2_buffer_t));
-	if(!s->buffer)
-	{
-		ERROR("Out of memory.");
-		return(-1);
-	}
+	memset(slow, 0, sizeof(*slow));
 	
-	s->buffer[0].length = s->fmt.fmt.pix.sizeimage;
-	s->buffer[0].start  = malloc(s->buffer[0].length);
+	memset(&fi, 0, sizeof(fi));
+	if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
+		fi.pixel_format = s->fmt.fmt.pix_mp.pixelformat;
+	else
+		fi.pixel_format = s->fmt.fmt.pix.pixelformat;
+	fi.width  = src->width;
+	fi.height = src->height;
 	
-	if(!s->buffer[0].start)
+	while(!ioctl(s->fd, VIDIOC_ENUM_FRAMEINTERVALS, &fi))
 	{
-		ERROR("Out of memory.");
+		if(fi.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+		{
+			*slow = fi.stepwise.max;
+			break;
+		}
 		
-		free(s->buffer);
-		s->buffer = NULL;
+		if(!slow->denominator ||
+		   src_v4l2_cmp_interval(&fi.discrete, slow) > 0)
+			*slow = fi.discrete;
 		
-		return(-1);
+		fi.index++;
 	}
 	
+	if(!slow->denominator || !slow->numerator) return(-1);
+	
 	return(0);
 }
 
-static int src_v4l2_open(src_t *src)
+int src_v4l2_requeue(src_t *src)
 {
-	src_v4l2_t *s;
-	
-	if(!src->source)
-	{
-		ERROR("No device name specified.");
-		return(-2);
-	}
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	enum v4l2_buf_type type = s->type;
+	uint32_t b;
 	
-	/* Allocate memory for the state structure. */
-	s = calloc(sizeof(src_v4l2_t), 1);
-	if(!s)
+	/* Stopping the stream returns every buffer to us. */
+	for(b = 0; b < s->req.count; b++)
 	{
-		ERROR("Out of memory.");
-		return(-2);
+		v4l2_buffer_t *pb = &s->buffer[b * s->planes];
+		
+		src_v4l2_init_buf(src, &s->buf, s->plane);
+		s->buf.index = b;
+		
+		if(s->memory == V4L2_MEMORY_USERPTR)
+		{
+			/* Replace the last buffer if it was detached. */
+			if((int) b == s->pframe && src->detached)
+			{
+				pb->start = src_pool_alloc(pb->length);
+				if(!pb->start)
+				{
+					ERROR("Out of memory.");
+					return(-1);
+				}
+				
+				src->detached = 0;
+			}
+			
+			s->buf.m.userptr = (unsigned long) pb->start;
+			s->buf.length    = pb->length;
+		}
+		
+		if(ioctl(s->fd, VIDIOC_QBUF, &s->buf) == -1)
+		{
+			ERROR("VIDIOC_QBUF: %s", strerror(errno));
+			return(-1);
+		}
 	}
 	
-	src->state = (void *) s;
+	s->pframe = -1;
 	
-	/* Open the device. */
-	s->fd = open(src->source, O_RDWR | O_NONBLOCK);
-	if(s->fd < 0)
+	if(ioctl(s->fd, VIDIOC_STREAMON, &type) == -1)
 	{
-		ERROR("Error opening device: %s", src->source);
-		ERROR("open: %s", strerror(errno));
-		free(s);
-		return(-2);
+		ERROR("Error starting stream.");
+		ERROR("VIDIOC_STREAMON: %s", strerror(errno));
+		return(-1);
 	}
 	
-	MSG("%s opened.", src->source);
+	return(0);
+}
+
+int src_v4l2_set_interval(src_t *src, struct v4l2_fract *interval)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	enum v4l2_buf_type type = s->type;
+	struct v4l2_streamparm parm;
 	
-	/* Get the device capabilities. */
-	if(src_v4l2_get_capability(src))
+	memset(&parm, 0, sizeof(parm));
+	parm.type = s->type;
+	parm.parm.capture.timeperframe = *interval;
+	
+	if(!ioctl(s->fd, VIDIOC_S_PARM, &parm))
 	{
-		src_v4l2_close(src);
-		return(-2);
+		/* Anything captured at the old rate is stale. */
+		if(s->map) src_v4l2_drain(src);
+		return(0);
 	}
 	
-	/* Set the input. */
-	if(src_v4l2_set_input(src))
+	/* Many drivers can only change the rate while stopped. */
+	if(errno != EBUSY || !s->map)
 	{
-		src_v4l2_close(src);
+		WARN("Error setting frame rate:");
+		WARN("VIDIOC_S_PARM: %s", strerror(errno));
 		return(-1);
 	}
 	
-	/* Set picture options. */
-	src_v4l2_set_controls(src);
-	
-	/* Set the pixel format. */
-	if(src_v4l2_set_pix_format(src))
+	if(ioctl(s->fd, VIDIOC_STREAMOFF, &type) == -1)
 	{
-		src_v4l2_close(src);
+		ERROR("VIDIOC_STREAMOFF: %s", strerror(errno));
 		return(-1);
 	}
 	
-	/* Set the frame-rate if > 0 */
-	if(src->fps) src_v4l2_set_fps(src);
-	
-	/* Delay to let the image settle down. */
-	if(src->delay)
+	if(ioctl(s->fd, VIDIOC_S_PARM, &parm) == -1)
 	{
-		MSG("Delaying %i seconds.", src->delay);
-		usleep(src->delay * 1000 * 1000);
+		WARN("Error setting frame rate:");
+		WARN("VIDIOC_S_PARM: %s", strerror(errno));
 	}
 	
-	/* Try to setup mmap. */
-	if(!src->use_read && src_v4l2_set_mmap(src))
+	return(src_v4l2_requeue(src));
+}
+
+int src_v4l2_set_standby(src_t *src, char on)
+{
+	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	struct v4l2_streamparm parm;
+	struct v4l2_fract slow;
+	
+	if(!s || !on == !s->standby) return(0);
+	
+	if(!on)
 	{
-		WARN("Unable to use mmap. Using read instead.");
-		src->use_read = -1;
+		DEBUG("Leaving standby.");
+		
+		s->standby = 0;
+		return(src_v4l2_set_interval(src, &s->interval));
 	}
 	
-	/* If unable to use mmap or user requested read(). */
-	if(src->use_read)
+	/* Remember the rate in use, and drop to the slowest. */
+	memset(&parm, 0, sizeof(parm));
+	parm.type = s->type;
+	
+	if(ioctl(s->fd, VIDIOC_G_PARM, &parm) == -1 ||
+	   !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME) ||
+	   src_v4l2_slowest_interval(src, &slow))
 	{
-		if(src_v4l2_set_read(src))
-		{
-			ERROR("Unable to use read.");
-			src_v4l2_close(src);
-			return(-1);
-		}
+		DEBUG("Device is unable to change its frame rate.");
+		return(-1);
 	}
 	
-	s->pframe = -1;
+	s->interval = parm.parm.capture.timeperframe;
+	
+	if(!src_v4l2_cmp_interval(&slow, &s->interval)) return(0);
+	
+	DEBUG("Standing by at %.2f fps.",
+	      (double) slow.denominator / slow.numerator);
+	
+	if(src_v4l2_set_interval(src, &slow)) return(-1);
+	
+	s->standby = -1;
 	
 	return(0);
 }
 
-static int src_v4l2_close(src_t *src)
+int src_v4l2_change_input(src_t *src)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	uint8_t list = src->list;
+	int r;
 	
-	if(s->buffer)
-	{
-		if(!s->map) free(s->buffer[0].start);
-		else src_v4l2_free_mmap(src);
-		free(s->buffer);
-	}
-	if(s->fd >= 0) close(s->fd);
-	free(s);
+	if(!s) return(-1);
+	
+	/* The inputs have already been listed. */
+	src->list = 0;
+	r = src_v4l2_set_input(src);
+	src->list = list;
+	
+	if(r) return(-1);
+	
+	/* Anything captured so far is from the old input. */
+	if(s->map) src_v4l2_drain(src);
 	
 	return(0);
 }
 
-static int src_v4l2_grab(src_t *src)
+static int src_v4l2_grab_frame(src_t *src)
 {
 	src_v4l2_t *s = (src_v4l2_t *) src->state;
+	int r;
 	
-	if(src->timeout)
+	if(s->map)
 	{
-		fd_set fds;
-		struct timeval tv;
-		int r;
-		
-		/* Is a frame ready? */
-		FD_ZERO(&fds);
-		FD_SET(s->fd, &fds);
-		
-		tv.tv_sec = src->timeout;
-		tv.tv_usec = 0;
-		
-		r = select(s->fd + 1, &fds, NULL, NULL, &tv);
-		
-		if(r == -1)
+		if(s->pframe >= 0)
 		{
-			ERROR("select: %s", strerror(errno));
-			return(-1);
+			/* Replace the previous buffer if it was detached. */
+			if(src->detached)
+			{
+				v4l2_buffer_t *b = &s->buffer[s->pframe];
+				
+				b->start = src_pool_alloc(b->length);
+				if(!b->start)
+				{
+					ERROR("Out of memory.");
+					return(-1);
+				}
+				
+				s->buf.m.userptr = (unsigned long) b->start;
+				src->detached = 0;
+			}
+			
+			if(ioctl(s->fd, VIDIOC_QBUF, &s->buf) == -1)
+			{
+				ERROR("VIDIOC_QBUF: %s", strerror(errno));
+				return(V4L2_LOST(errno) ? 1 : -1);
+			}
+			
+			s->pframe = -1;
 		}
 		
-		if(!r)
+		/* Throw away anything captured before the trigger. */
+		if(src->fresh && timerisset(&src->trigger))
 		{
-			ERROR("Timed out waiting for frame!");
-			return(-1);
+			if(src_v4l2_drain(src) == -1) return(-1);
 		}
-	}
-	
-	if(s->map)
-	{
-		if(s->pframe >= 0)
+		
+		while(1)
 		{
+			if((r = src_v4l2_wait(src))) return(r);
+			
+			src_v4l2_init_buf(src, &s->buf, s->plane);
+			
+			if(ioctl(s->fd, VIDIOC_DQBUF, &s->buf) == -1)
+			{
+				ERROR("VIDIOC_DQBUF: %s", strerror(errno));
+				return(V4L2_LOST(errno) ? 1 : -1);
+			}
+			
+			if(!src->fresh || !timerisset(&src->trigger)) break;
+			
+			/* Without a monotonic timestamp the drain will have to do. */
+			if((s->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) !=
+			   V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) break;
+			
+			if(!timercmp(&s->buf.timestamp, &src->trigger, <)) break;
+			
+			/* This frame was started before the trigger. */
 			if(ioctl(s->fd, VIDIOC_QBUF, &s->buf) == -1)
 			{
 				ERROR("VIDIOC_QBUF: %s", strerror(errno));
@@ -937,46 +2540,182 @@ static int src_v4l2_grab(src_t *src)
 			}
 		}
 		
-		memset(&s->buf, 0, sizeof(s->buf));
+		/* The rest of this capture will be fresh. */
+		timerclear(&src->trigger);
+		
+		/* Use the driver's timestamp if it is from the monotonic clock. */
+		if((s->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+		   V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+			src->timestamp = s->buf.timestamp;
+		
+		src->img    = s->buffer[s->buf.index * s->planes].start;
+		src->length = s->buffer[s->buf.index * s->planes].length;
+		src->img_size = src->length;
 		
-		s->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		s->buf.memory = V4L2_MEMORY_MMAP;
+		if(s->memory == V4L2_MEMORY_USERPTR && s->buf.bytesused)
+			src->length = s->buf.bytesused;
 		
-		if(ioctl(s->fd, VIDIOC_DQBUF, &s->buf) == -1)
+		if(s->memory == V4L2_MEMORY_MMAP)
+			src->dmabuf_fd = s->buffer[s->buf.index * s->planes].dmabuf;
+		
+		/* Pass on the location of each plane. */
+		if(V4L2_TYPE_IS_MULTIPLANAR(s->type))
 		{
-			ERROR("VIDIOC_DQBUF: %s", strerror(errno));
-			return(-1);
+			uint8_t p;
+			
+			src->planes = s->planes;
+			
+			for(p = 0; p < s->planes && p < SRC_MAX_PLANES; p++)
+			{
+				src->plane[p] = s->buffer[s->buf.index * s->planes + p].start;
+				src->plane_length[p] = s->plane[p].bytesused;
+				src->plane_stride[p] = s->fmt.fmt.pix_mp.plane_fmt[p].bytesperline;
+				
+				if(!src->plane_length[p])
+					src->plane_length[p] = s->plane[p].length;
+			}
+			
+			src->length = src->plane_length[0];
 		}
 		
-		src->img    = s->buffer[s->buf.index].start;
-		src->length = s->buffer[s->buf.index].length;
+		src->sequence = s->buf.sequence;
+		if(s->buf.flags & V4L2_BUF_FLAG_ERROR)
+		{
+			DEBUG("Buffer %i has the error flag set.", s->buf.index);
+			src->error_frames++;
+		}
 		
 		s->pframe = s->buf.index;
 	}
 	else
 	{
-		ssize_t r;
+		ssize_t length;
+		
+		if((r = src_v4l2_wait(src))) return(r);
 		
-		r = read(s->fd, s->buffer[0].start, s->buffer[0].length);
-		if(r <= 0)
+		length = read(s->fd, s->buffer[0].start, s->buffer[0].length);
+		if(length <= 0)
 		{
 			ERROR("Unable to read a frame.");
 			ERROR("read: %s", strerror(errno));
-			return(-1);
+			return(length && V4L2_LOST(errno) ? 1 : -1);
 		}
 		
 		src->img = s->buffer[0].start;
-		src->length = r;
+		src->length = length;
+	}
+	
+	return(0);
+}
+
+static int src_v4l2_recover(src_t *src)
+{
+	struct timespec start, now;
+	uint32_t width = src->width, height = src->height;
+	uint32_t delay = src->delay;
+	uint8_t list = src->list;
+	useconds_t wait = 10000;
+	double seconds;
+	int r = -1;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	WARN("Lost %s. Reopening...", src->source);
+	
+	src_v4l2_close(src);
+	src->state = NULL;
+	
+	/* Open the device again once it is back. Give up
+	 * after the timeout, if there is one. */
+	src->delay = 0;
+	src->list  = 0;
+	
+	while(1)
+	{
+		if(!access(src->source, F_OK))
+		{
+			r = src_v4l2_open(src);
+			if(!r) break;
+			
+			src->state = NULL;
+		}
+		
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		seconds = (now.tv_sec - start.tv_sec) +
+		          (now.tv_nsec - start.tv_nsec) / 1000000000.0;
+		
+		if(src->timeout && seconds * 1000 >= src->timeout) break;
+		
+		usleep(wait);
+		if(wait < 500000) wait *= 2;
+	}
+	
+	src->delay = delay;
+	src->list  = list;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	seconds = (now.tv_sec - start.tv_sec) +
+	          (now.tv_nsec - start.tv_nsec) / 1000000000.0;
+	
+	src->outages++;
+	src->outage_time += seconds;
+	
+	if(r)
+	{
+		ERROR("Unable to recover %s after %.2f seconds.", src->source, seconds);
+		return(-1);
+	}
+	
+	MSG("%s recovered after %.2f seconds.", src->source, seconds);
+	
+	/* The image can't change size part way through a capture.
+	 * Close the device so nothing is grabbed at the new size. */
+	if(src->width != width || src->height != height)
+	{
+		MSG("Resolution is now %ix%i. Ending this capture.",
+		    src->width, src->height);
+		
+		src_v4l2_close(src);
+		src->state  = NULL;
+		src->width  = width;
+		src->height = height;
+		
+		return(-1);
 	}
 	
 	return(0);
 }
 
+static int src_v4l2_grab(src_t *src)
+{
+	int r, tries = 0;
+	
+	/* The device was lost and couldn't be recovered. */
+	if(!src->state) return(-1);
+	
+	/* Reopen the device and try again if it was lost. */
+	while((r = src_v4l2_grab_frame(src)) == 1)
+	{
+		if(++tries > 3)
+		{
+			ERROR("Giving up on %s.", src->source);
+			return(-1);
+		}
+		
+		if(src_v4l2_recover(src)) return(-1);
+	}
+	
+	return(r);
+}
+
 src_mod_t src_v4l2 = {
 	"v4l2", SRC_TYPE_DEVICE,
 	src_v4l2_open,
 	src_v4l2_close,
-	src_v4l2_grab
+	src_v4l2_grab,
+	src_v4l2_set_controls,
+	src_v4l2_set_standby,
+	src_v4l2_change_input
 };
 
 #else /* #ifdef HAVE_V4L2 */
@@ -985,6 +2724,7 @@ src_mod_t src_v4l2 = {
 	"", SRC_TYPE_NONE,
         NULL,
         NULL,
+        NULL,
         NULL
 };
 